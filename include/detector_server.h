@@ -0,0 +1,136 @@
+// -*- mode: c++ -*-
+
+#ifndef DETECTOR_SERVER_H
+#define DETECTOR_SERVER_H
+
+/****
+Copyright (c) 2020-2021 Adrian I. Lam
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+****/
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "facial_landmark_detector.h"
+
+/*! Hosts many independent detectors ("tenants") in one process.
+ *
+ *  Instead of one blocking thread per detector, a small pool of worker
+ *  threads waits on a shared epoll set containing the sockets of all
+ *  tenants. Each tenant has its own config file (and hence its own port).
+ *
+ *  Linux only.
+ */
+class DetectorServer
+{
+public:
+    struct TenantStats
+    {
+        std::string name;
+        std::uint64_t numPackets;  // Datagrams received
+        std::uint64_t numFrames;   // Frames processed
+        std::uint64_t numIgnored;  // Datagrams that were not a frame for our face
+        std::uint64_t busyNs;      // Total time spent processing frames
+        std::uint64_t maxFrameNs;  // Longest time spent on a single frame
+    };
+
+    /*! numWorkers = 0 means one worker per CPU */
+    DetectorServer(unsigned int numWorkers = 0);
+    ~DetectorServer();
+
+    /*! Create a detector with the given config file and start serving it.
+     *  May be called before or after start(). The returned detector is
+     *  owned by the server; use it for getParams().
+     */
+    FacialLandmarkDetector& addTenant(std::string name, std::string cfgPath);
+
+    void start(void);
+    void stop(void);
+
+    std::vector<TenantStats> getTenantStats(void) const;
+
+    unsigned int numWorkers(void) const;
+
+private:
+    DetectorServer(const DetectorServer&) = delete;
+    DetectorServer& operator=(const DetectorServer&) = delete;
+
+    struct Tenant;
+
+    /*! One socket of one tenant, as registered in the epoll set */
+    struct Source
+    {
+        Tenant *tenant;
+        std::size_t streamIndex;
+        int sock;
+    };
+
+    struct Tenant
+    {
+        std::string name;
+        std::unique_ptr<FacialLandmarkDetector> detector;
+        std::vector<Source> sources;
+
+        // Held while a worker is processing packets for this tenant,
+        // since a tenant with several streams may have more than one
+        // socket ready at the same time.
+        std::mutex mutex;
+        TenantStats stats;
+    };
+
+    /*! Sockets taken from the epoll set by one worker but not yet
+     *  serviced. Idle workers steal from the other workers' queues.
+     *  A worker that queues several wakes one idle worker (through
+     *  m_wakeFd) for each beyond the first.
+     */
+    struct WorkQueue
+    {
+        static const int capacity = 16;
+
+        std::mutex mutex;
+        Source *items[capacity];
+        int head;
+        int size;
+
+        WorkQueue(void) : head(0), size(0) {}
+    };
+
+    void workerLoop(unsigned int workerIndex);
+    Source *popWork(unsigned int workerIndex);
+    void serviceSource(Source *source);
+    void rearm(Source *source);
+
+    unsigned int m_numWorkers;
+    int m_epollFd;
+    int m_wakeFd; // eventfd in the epoll set, to wake idle workers
+    std::atomic<bool> m_stop;
+    std::vector<std::thread> m_workers;
+    std::unique_ptr<WorkQueue[]> m_queues;
+
+    mutable std::mutex m_tenantsMutex;
+    std::vector<std::unique_ptr<Tenant>> m_tenants;
+};
+
+#endif
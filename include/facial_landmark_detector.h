@@ -25,8 +25,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ****/
 
-#include <deque>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <istream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 struct Point
 {
@@ -54,24 +61,195 @@ public:
         double faceXAngle;
         double faceYAngle;
         double faceZAngle;
+        // Eyebrows are taken from the features computed by OSF itself,
+        // as the landmarks alone are too noisy for them (at least for my
+        // face). Both are roughly -1 to 1, and 0 at rest.
+        double leftEyebrowUpDown;
+        double rightEyebrowUpDown;
+        double leftEyebrowAngle;   // Steepness
+        double rightEyebrowAngle;
         bool autoBlink;
         bool autoBreath;
         bool randomMotion;
-        // TODO eyebrows currently not supported...
-        // I'd like to include them, but the dlib / OSF detection is very
-        // noisy and inaccurate (at least for my face).
     };
 
-    FacialLandmarkDetector(std::string cfgPath);
+    /*! Index of each parameter in Params, for use in parameter bindings */
+    enum ParamIndex
+    {
+        PARAM_LEFT_EYE_OPENNESS,
+        PARAM_RIGHT_EYE_OPENNESS,
+        PARAM_LEFT_EYE_SMILE,
+        PARAM_RIGHT_EYE_SMILE,
+        PARAM_MOUTH_OPENNESS,
+        PARAM_MOUTH_FORM,
+        PARAM_FACE_X_ANGLE,
+        PARAM_FACE_Y_ANGLE,
+        PARAM_FACE_Z_ANGLE,
+        PARAM_LEFT_EYEBROW_UP_DOWN,
+        PARAM_RIGHT_EYEBROW_UP_DOWN,
+        PARAM_LEFT_EYEBROW_ANGLE,
+        PARAM_RIGHT_EYEBROW_ANGLE,
+        NUM_PARAMS
+    };
+
+    /*! Maps one of our parameters to a Cubism parameter ID.
+     *  Set with "paramBinding" lines in the config file.
+     */
+    struct Binding
+    {
+        ParamIndex param;
+        std::string cubismId;
+    };
+
+    static const std::size_t maxBindings = 32;
+
+    /*! Parameter values in binding order, so that they can be applied
+     *  to a model with a simple indexed loop.
+     */
+    struct alignas(64) ParamArray
+    {
+        float values[maxBindings];
+        std::size_t size; // Number of bindings
+        bool autoBlink;
+        bool autoBreath;
+        bool randomMotion;
+    };
+
+    struct ThreadStats
+    {
+        // Number of frames processed so far
+        std::uint64_t numFrames;
+        // Number of those frames where the face had not moved enough, so
+        // the features of the previous frame were reused (see
+        // motionSkipThreshold in the config file)
+        std::uint64_t numSkippedFrames;
+        // The following are taken from the kernel's scheduler statistics
+        // for the detector thread (Linux only, zero elsewhere).
+        // Time spent running on a CPU
+        std::uint64_t runTimeNs;
+        // Time spent runnable but waiting for a CPU, i.e. scheduling delay
+        std::uint64_t runDelayNs;
+        // Number of times the thread was scheduled onto a CPU
+        std::uint64_t numTimeslices;
+        // The following need kernel receive timestamps (osfKernelTimestamps
+        // in the config file; Linux only, zero elsewhere).
+        // Number of processed frames that had a timestamp
+        std::uint64_t numTimestampedFrames;
+        // Total time from their arrival in the kernel until they were read
+        // from the socket, i.e. queueing and wakeup delay, and the longest
+        std::uint64_t queueDelayNs;
+        std::uint64_t maxQueueDelayNs;
+        // Total time from their arrival until the parameters were updated
+        std::uint64_t latencyNs;
+        // Packets dropped by the kernel because the socket receive buffer
+        // was full (see osfRecvBufferSize; Linux only)
+        std::uint64_t numKernelDrops;
+    };
+
+    /*! Online measures of the output quality of one parameter, over
+     *  roughly the last qualityWindow frames (see the config file).
+     */
+    struct QualityStats
+    {
+        // Frames measured so far
+        std::uint64_t numFrames;
+        // Mean squared second difference of the output, i.e. the energy
+        // of frame-to-frame jitter...
+        double jitter;
+        // ... and the same before filtering. jitter / rawJitter is how
+        // much of the jitter the filters remove.
+        double rawJitter;
+        // Delay (in frames) at which the output best matches the values
+        // before filtering, i.e. the lag added by the filters
+        double lag;
+        // Fraction of frames where the value before filtering was at its
+        // lower / upper limit, e.g. clamped by the thresholds in the
+        // config file or by the +-30 degree limit of the X and Y angles
+        double saturatedLow;
+        double saturatedHigh;
+    };
+
+    enum InputMode
+    {
+        INPUT_SOCKET,  // Receive frames from OSF over UDP
+        INPUT_OFFLINE  // No sockets; frames are fed in with processPacket()
+    };
+
+    /*! Size of one UDP packet (one face in one frame) sent by OSF */
+    static const std::size_t osfPacketSize;
+
+    /*! Number of facial landmarks per frame */
+    static const int numLandmarks = 68;
+
+    /*! cfgPath is the path to the config file (empty for defaults).
+     *  cfgOverrides holds further config lines, applied on top of it.
+     */
+    FacialLandmarkDetector(std::string cfgPath,
+                           InputMode inputMode = INPUT_SOCKET,
+                           std::string cfgOverrides = "");
     ~FacialLandmarkDetector();
 
     Params getParams(void) const;
 
+    /*! Start the detector in a thread owned by the library, applying
+     *  the thread options (CPU affinity, scheduling, name) in the config.
+     *  Throws std::runtime_error if the options cannot be applied.
+     */
+    void start(void);
+
+    /*! Stop the detector. If it was started with start(), this also
+     *  waits for the thread to exit.
+     */
     void stop(void);
 
+    /*! Run the detector in the calling thread until stop() is called.
+     *  Use start() instead if the library should manage the thread.
+     */
     void mainLoop(void);
 
+    ThreadStats getThreadStats(void) const;
+
+    /*! Quality measures of a parameter. The eye smile parameters are
+     *  derived when reading the parameters, not filtered, so theirs stay
+     *  zero.
+     */
+    QualityStats getQualityStats(ParamIndex param) const;
+
+    /*! Process one OSF packet as if it had been received on the given
+     *  stream (0 = osfPort, 1 = first osfExtraStream, ...). This is how
+     *  an offline detector is fed, e.g. from a recording.
+     *  Returns true if the packet was a frame for our face.
+     */
+    bool processPacket(const char *buf, std::size_t size,
+                       std::size_t streamIndex = 0);
+
+    /*! Fill in the current parameter values in binding order. */
+    void getParamArray(ParamArray& params) const;
+
+    const std::vector<Binding>& getBindings(void) const;
+
+    /*! Resolve the Cubism parameter ID of every binding once, e.g. at model
+     *  load, using the given function (typically one calling
+     *  CubismIdManager::GetId). Returns the resolved IDs in binding order,
+     *  i.e. in the same order as the values in ParamArray.
+     */
+    template<class Resolver>
+    auto resolveBindings(Resolver resolve) const
+        -> std::vector<decltype(resolve(std::string()))>
+    {
+        std::vector<decltype(resolve(std::string()))> ids;
+        for (const Binding& binding : m_cfg.paramBindings)
+        {
+            ids.push_back(resolve(binding.cubismId));
+        }
+        return ids;
+    }
+
 private:
+    // The server drives detectors from its own worker threads
+    // instead of mainLoop()
+    friend class DetectorServer;
+
     FacialLandmarkDetector(const FacialLandmarkDetector&) = delete;
     FacialLandmarkDetector& operator=(const FacialLandmarkDetector &) = delete;
 
@@ -81,49 +259,330 @@ private:
         RIGHT
     };
 
-    bool m_stop;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+    std::atomic<long> m_threadId; // Kernel thread ID running mainLoop
+    std::atomic<std::uint64_t> m_numFrames;
+    std::atomic<std::uint64_t> m_numSkippedFrames;
+    std::atomic<std::uint64_t> m_numTimestampedFrames;
+    std::atomic<std::uint64_t> m_queueDelayNs;
+    std::atomic<std::uint64_t> m_maxQueueDelayNs;
+    std::atomic<std::uint64_t> m_latencyNs;
+    std::atomic<std::uint64_t> m_numKernelDrops;
+    InputMode m_inputMode;
 
-    int m_sock;
     static const int m_faceId = 0; // Only support one face for now
 
-    double calcEyeAspectRatio(Point& p1, Point& p2,
-                              Point& p3, Point& p4,
-                              Point& p5, Point& p6) const;
+    /*! Feature values calculated from a single frame, before filtering */
+    struct Features
+    {
+        double faceXAngle;
+        double faceYAngle;
+        double faceZAngle;
+        double mouthForm;
+        double mouthOpenness;
+        double leftEyeOpenness;
+        double rightEyeOpenness;
+        double leftEyebrowUpDown;
+        double rightEyebrowUpDown;
+        double leftEyebrowAngle;
+        double rightEyebrowAngle;
+    };
+
+    /*! Where the eye and mouth features come from */
+    enum FeatureSource
+    {
+        FEATURES_LANDMARKS, // Calculated here from the landmark geometry
+        FEATURES_OSF        // Taken from the features block of the OSF packet
+    };
+
+    /*! An OSF stream, i.e. one camera */
+    struct Stream
+    {
+        int sock;
+        double yawOffset;   // Angle of this camera relative to the primary one
+        bool valid;         // Whether a frame has been received yet
+        double timestamp;   // OSF timestamp of the latest frame
+        double confidence;  // Mean landmark confidence of the latest frame
+        Features features;  // Features calculated from the latest frame
+
+        // Landmarks of the frame the features were calculated from,
+        // and the distance between the eyes in that frame
+        Point landmarks[numLandmarks];
+        double eyeDistance;
+
+        // Drop counter of the socket, as last reported by the kernel
+        std::uint32_t kernelDrops;
+
+        Stream(int _sock, double _yawOffset)
+            : sock(_sock), yawOffset(_yawOffset), valid(false),
+              timestamp(0), confidence(0), features(), eyeDistance(0),
+              kernelDrops(0)
+        {
+        }
+    };
+
+    std::vector<Stream> m_streams;
+
+    int openSocket(int port);
+    void setSocketOptions(int sock, bool multicast);
+    static void closeSocket(int sock);
+
+    // Rebroadcasting of the processed parameters (see param_codec.h)
+    int m_rebroadcastSock;
+    std::uint32_t m_rebroadcastSequence;
+    int m_rebroadcastSinceKeyframe;
+    std::int32_t m_rebroadcastQuantized[NUM_PARAMS];
+
+    void openRebroadcastSocket(void);
+    void rebroadcast(void);
+
+    enum RecvResult
+    {
+        RECV_NOTHING,   // No packet was available
+        RECV_IGNORED,   // Packet was not a frame for our face
+        RECV_PROCESSED
+    };
+
+    RecvResult receivePacket(std::size_t streamIndex, int flags = 0);
+    bool processPacket(std::size_t streamIndex, const char *buf);
+
+    bool isStatic(const Stream& stream, const Point landmarks[]) const;
+    void readOsfFeatures(const char *buf, Features& features) const;
+    void calcFeatures(const Point landmarks[], Features& features,
+                      double& eyeDistance) const;
+    bool isFusionLeader(std::size_t streamIndex) const;
+    void fuseStreams(std::size_t latestIndex, Features& fused) const;
+
+    double calcEyeAspectRatio(const Point& p1, const Point& p2,
+                              const Point& p3, const Point& p4,
+                              const Point& p5, const Point& p6) const;
 
     double calcRightEyeAspectRatio(Point landmarks[]) const;
     double calcLeftEyeAspectRatio(Point landmarks[]) const;
 
-    double calcEyeOpenness(LeftRight eye,
-                           Point landmarks[],
-                           double faceYAngle) const;
+    /*! Geometry shared by several calc*() functions, computed once
+     *  per frame so that each of them does not redo the work.
+     */
+    struct FeatureContext
+    {
+        const Point *landmarks;
+        Point rightEye;       // Centroid of landmarks 36-41
+        Point leftEye;        // Centroid of landmarks 42-47
+        double eyeDistance;   // Distance between the two eye centroids
+        double mouthWidth;    // Distance between the mouth corners
+        double faceYAngleCos; // Cosine of faceYAngle, set once it is known
+    };
+
+    void initFeatureContext(FeatureContext& ctx, const Point landmarks[]) const;
 
-    double calcMouthForm(Point landmarks[]) const;
-    double calcMouthOpenness(Point landmarks[], double mouthForm) const;
+    double calcEyeOpenness(LeftRight eye, const FeatureContext& ctx) const;
 
-    double calcFaceXAngle(Point landmarks[]) const;
-    double calcFaceYAngle(Point landmarks[], double faceXAngle, double mouthForm) const;
-    double calcFaceZAngle(Point landmarks[]) const;
+    double calcMouthForm(const FeatureContext& ctx) const;
+    double calcMouthOpenness(const FeatureContext& ctx, double mouthForm) const;
+
+    double calcFaceXAngle(const FeatureContext& ctx) const;
+    double calcFaceYAngle(const FeatureContext& ctx, double faceXAngle, double mouthForm) const;
+    double calcFaceZAngle(const FeatureContext& ctx) const;
+
+    void applyThreadConfig(void);
 
     void populateDefaultConfig(void);
-    void parseConfig(std::string cfgPath);
+    void parseConfig(std::string cfgPath, std::string cfgOverrides);
+    void parseConfigLines(std::istream& file, bool& hasParamBindings);
     void throwConfigError(std::string paramName, std::string expectedType,
                           std::string line, unsigned int lineNum);
 
 
-    std::deque<double> m_leftEyeOpenness;
-    std::deque<double> m_rightEyeOpenness;
+    /*! Moving average over the last numTaps values.
+     *  The buffer is allocated once in setNumTaps(), so that processing
+     *  a frame does not touch the heap.
+     */
+    class MovingAverage
+    {
+    public:
+        MovingAverage(void);
+
+        void setNumTaps(std::size_t numTaps);
+        void push(double newval);
+        double avg(double defaultValue = 0) const;
+
+        /*! The values currently held, oldest first */
+        void getValues(std::vector<double>& values) const;
+
+    private:
+        std::vector<double> m_buf;
+        std::size_t m_next; // Index to write the next value to
+        std::size_t m_size; // Number of values currently held
+    };
+
+    /*! Sliding window median, used to reject single-frame glitches
+     *  before they reach the moving average.
+     *
+     *  The window is kept in a max-heap and a min-heap meeting at the
+     *  median, indexed by position in the window, so that replacing the
+     *  oldest value costs O(log n) and does not touch the heap (memory).
+     *
+     *  With hampelThreshold > 0 this is a Hampel filter instead: a value
+     *  is only replaced by the median if it is more than hampelThreshold
+     *  standard deviations away from it, where the standard deviation is
+     *  estimated from the median absolute deviation of the window. That
+     *  stage is O(n) per value, since every deviation changes with the
+     *  median; for the short windows this is meant for (3 to 9 taps) it
+     *  costs about as much as the heap updates.
+     */
+    class SlidingMedian
+    {
+    public:
+        SlidingMedian(void);
 
-    std::deque<double> m_mouthOpenness;
-    std::deque<double> m_mouthForm;
+        /*! numTaps = 0 disables the filter */
+        void setNumTaps(std::size_t numTaps, double hampelThreshold = 0);
+        double filter(double newval);
+
+        /*! The values in the window, oldest first */
+        void getValues(std::vector<double>& values) const;
+
+    private:
+        bool less(int i, int j) const;
+        bool compareExchange(int i, int j);
+        void minSortDown(int i);
+        void maxSortDown(int i);
+        bool minSortUp(int i);
+        bool maxSortUp(int i);
+        int& heap(int i);
+        int minCount(void) const;
+        int maxCount(void) const;
+        double median(void) const;
+
+        std::vector<double> m_data; // Window values, oldest overwritten first
+        std::vector<int> m_pos;     // Heap index of each window value
+        std::vector<int> m_heap;    // Window indices; heap(0) is the median,
+                                    // heap(i > 0) the min-heap and heap(i < 0)
+                                    // the max-heap
+        std::vector<double> m_deviations; // Scratch space for the Hampel filter
+        int m_numTaps;
+        int m_count;
+        int m_next;
+        double m_hampelThreshold;
+    };
+
+    /*! Online quality measures of one parameter (see QualityStats).
+     *  Exponentially weighted, so updating is O(1) and allocation free.
+     */
+    class QualityMeter
+    {
+    public:
+        QualityMeter(void);
+
+        void setWindow(double numFrames);
+        void setLimits(double low, double high);
+        void update(double raw, double filtered);
+        QualityStats stats(void) const;
+
+    private:
+        static const int maxLag = 15;
+
+        double m_window;
+        double m_low;
+        double m_high;
+        std::uint64_t m_numFrames;
+
+        double m_raw[maxLag + 1];  // Recent values before filtering
+        int m_next;                // Index of the next one in m_raw
+        double m_filtered[2];      // Last two outputs, newest first
+
+        double m_jitter;
+        double m_rawJitter;
+        double m_lagError[maxLag + 1];
+        double m_saturatedLow;
+        double m_saturatedHigh;
+    };
+
+    // Protects the filters, which are written by mainLoop and read
+    // by getParams from another thread
+    mutable std::mutex m_mutex;
+
+    // Also protected by m_mutex, indexed by ParamIndex
+    QualityMeter m_quality[NUM_PARAMS];
+
+    // The quality dump (qualityDumpPath) is formatted and written by a
+    // low-priority thread of its own. The detector thread only hands it
+    // a copy of the measures, so it neither allocates nor does file I/O.
+    std::chrono::steady_clock::time_point m_nextQualityDump;
+    std::thread m_qualityDumpThread;
+    std::mutex m_qualityDumpMutex;
+    std::condition_variable m_qualityDumpCond;
+    bool m_qualityDumpPending;             // Protected by m_qualityDumpMutex
+    bool m_qualityDumpStop;                // Likewise
+    QualityStats m_qualityDump[NUM_PARAMS]; // Likewise
+
+    bool requestQualityDump(void);
+    void qualityDumpLoop(void);
+    void writeQualityDump(const QualityStats stats[], const std::string& tmpPath) const;
+
+    MovingAverage m_leftEyeOpenness;
+    MovingAverage m_rightEyeOpenness;
+
+    MovingAverage m_mouthOpenness;
+    MovingAverage m_mouthForm;
+
+    MovingAverage m_faceXAngle;
+    MovingAverage m_faceYAngle;
+    MovingAverage m_faceZAngle;
+
+    MovingAverage m_leftEyebrowUpDown;
+    MovingAverage m_rightEyebrowUpDown;
+    MovingAverage m_leftEyebrowAngle;
+    MovingAverage m_rightEyebrowAngle;
+
+    // Only used by mainLoop, so not protected by m_mutex
+    SlidingMedian m_leftEyeOpennessMedian;
+    SlidingMedian m_rightEyeOpennessMedian;
+    SlidingMedian m_mouthOpennessMedian;
+    SlidingMedian m_mouthFormMedian;
+    SlidingMedian m_faceXAngleMedian;
+    SlidingMedian m_faceYAngleMedian;
+    SlidingMedian m_faceZAngleMedian;
+    SlidingMedian m_leftEyebrowUpDownMedian;
+    SlidingMedian m_rightEyebrowUpDownMedian;
+    SlidingMedian m_leftEyebrowAngleMedian;
+    SlidingMedian m_rightEyebrowAngleMedian;
+
+    /*! A filtered parameter, as named in the state file */
+    struct FilterRef
+    {
+        const char *name;
+        MovingAverage *average;
+        SlidingMedian *median;
+    };
+    std::vector<FilterRef> filterRefs(void);
 
-    std::deque<double> m_faceXAngle;
-    std::deque<double> m_faceYAngle;
-    std::deque<double> m_faceZAngle;
+    void saveState(void);
+    void restoreState(void);
+    bool parseState(const char *data, std::size_t size, bool apply);
 
     struct Config
     {
         std::string osfIpAddress;
         int osfPort;
+        struct ExtraStream
+        {
+            int port;
+            double yawOffset;
+        };
+        std::vector<ExtraStream> osfExtraStreams;
+        std::string osfMulticastInterface;
+        bool osfReusePort;
+        int osfRecvBufferSize;
+        int osfBusyPoll;
+        bool osfKernelTimestamps;
+        double osfFusionMaxSkew;
+        double motionSkipThreshold;
+        FeatureSource featureSource;
+        std::string rebroadcastAddress;
+        int rebroadcastPort;
+        int rebroadcastKeyframeInterval;
         double faceYAngleCorrection;
         double eyeSmileEyeOpenThreshold;
         double eyeSmileMouthFormThreshold;
@@ -135,6 +594,23 @@ private:
         std::size_t mouthOpenNumTaps;
         std::size_t leftEyeOpenNumTaps;
         std::size_t rightEyeOpenNumTaps;
+        std::size_t eyebrowNumTaps;
+        std::size_t faceXAngleMedianTaps;
+        std::size_t faceYAngleMedianTaps;
+        std::size_t faceZAngleMedianTaps;
+        std::size_t mouthFormMedianTaps;
+        std::size_t mouthOpenMedianTaps;
+        std::size_t leftEyeOpenMedianTaps;
+        std::size_t rightEyeOpenMedianTaps;
+        std::size_t eyebrowMedianTaps;
+        double faceXAngleHampelThreshold;
+        double faceYAngleHampelThreshold;
+        double faceZAngleHampelThreshold;
+        double mouthFormHampelThreshold;
+        double mouthOpenHampelThreshold;
+        double leftEyeOpenHampelThreshold;
+        double rightEyeOpenHampelThreshold;
+        double eyebrowHampelThreshold;
         double eyeClosedThreshold;
         double eyeOpenThreshold;
         double mouthNormalThreshold;
@@ -142,6 +618,12 @@ private:
         double mouthClosedThreshold;
         double mouthOpenThreshold;
         double mouthOpenLaughCorrection;
+        double osfEyeClosedThreshold;
+        double osfEyeOpenThreshold;
+        double osfMouthNormalThreshold;
+        double osfMouthSmileThreshold;
+        double osfMouthClosedThreshold;
+        double osfMouthOpenThreshold;
         double faceYAngleXRotCorrection;
         double faceYAngleSmileCorrection;
         double faceYAngleZeroValue;
@@ -151,6 +633,16 @@ private:
         bool autoBlink;
         bool autoBreath;
         bool randomMotion;
+        std::vector<int> threadCpuAffinity;
+        int threadRealtimePriority;
+        int threadNiceness;
+        std::string threadName;
+        std::string stateFile;
+        double stateMaxAge;
+        double qualityWindow;
+        std::string qualityDumpPath;
+        double qualityDumpInterval;
+        std::vector<Binding> paramBindings;
     } m_cfg;
 };
 
@@ -0,0 +1,94 @@
+// -*- mode: c++ -*-
+
+#ifndef PARAM_RECEIVER_H
+#define PARAM_RECEIVER_H
+
+/****
+Copyright (c) 2020-2021 Adrian I. Lam
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+****/
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "facial_landmark_detector.h"
+
+/*! Receives the parameters rebroadcast by a FacialLandmarkDetector
+ *  (see rebroadcastAddress in the config file), e.g. on another machine
+ *  that only renders the model.
+ *
+ *  Usage mirrors FacialLandmarkDetector: start() the receiving thread,
+ *  then poll getParams() once per rendered frame.
+ *
+ *  If the sender restarts, its sequence numbers start again from 0; the
+ *  receiver follows it from its first keyframe. Packets up to 64 behind
+ *  the latest one, keyframes included, are taken to be late rather than
+ *  from a restart, and ignored.
+ */
+class ParamReceiver
+{
+public:
+    struct Stats
+    {
+        std::uint64_t numPackets;  // Packets applied
+        std::uint64_t numLost;     // Gaps in the sequence numbers
+        std::uint64_t numRejected; // Malformed, or deltas while waiting for a keyframe
+        std::uint64_t numResets;   // Sender restarts, i.e. sequence numbers going back
+    };
+
+    ParamReceiver(std::string ipAddress = "0.0.0.0", int port = 11574);
+    ~ParamReceiver();
+
+    /*! Parameters of the latest packet. Until the first keyframe is
+     *  received, the face is neutral with the eyes open.
+     */
+    FacialLandmarkDetector::Params getParams(void) const;
+
+    void start(void);
+    void stop(void);
+
+    void mainLoop(void);
+
+    Stats getStats(void) const;
+
+private:
+    ParamReceiver(const ParamReceiver&) = delete;
+    ParamReceiver& operator=(const ParamReceiver&) = delete;
+
+    void processPacket(const unsigned char *buf, std::size_t size);
+
+    int m_sock;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+
+    // Only touched by the receiving thread
+    bool m_synced;                  // Whether m_quantized is valid
+    std::uint32_t m_lastSequence;
+    std::int32_t m_quantized[FacialLandmarkDetector::NUM_PARAMS];
+
+    mutable std::mutex m_mutex;
+    FacialLandmarkDetector::Params m_params;
+    Stats m_stats;
+};
+
+#endif
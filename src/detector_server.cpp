@@ -0,0 +1,309 @@
+/****
+Copyright (c) 2020-2021 Adrian I. Lam
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+****/
+
+#include <chrono>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "detector_server.h"
+
+static const int epollTimeoutMs = 100;
+
+// Max number of packets handled for one socket before giving other
+// sockets a chance
+static const int maxPacketsPerService = 32;
+
+DetectorServer::DetectorServer(unsigned int numWorkers)
+    : m_numWorkers(numWorkers), m_stop(true)
+{
+    if (m_numWorkers == 0)
+    {
+        m_numWorkers = std::thread::hardware_concurrency();
+        if (m_numWorkers == 0)
+        {
+            m_numWorkers = 1;
+        }
+    }
+
+    m_queues.reset(new WorkQueue[m_numWorkers]);
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd < 0)
+    {
+        throw std::runtime_error("Cannot create epoll instance");
+    }
+
+    // Level-triggered, so that it keeps waking idle workers, one at a
+    // time, for as long as it holds a count. Its data.ptr is null, which
+    // tells it apart from the sockets.
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (m_wakeFd < 0 || epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev) != 0)
+    {
+        if (m_wakeFd >= 0)
+        {
+            close(m_wakeFd);
+        }
+        close(m_epollFd);
+        throw std::runtime_error("Cannot create wakeup eventfd");
+    }
+}
+
+DetectorServer::~DetectorServer()
+{
+    stop();
+    close(m_wakeFd);
+    close(m_epollFd);
+}
+
+FacialLandmarkDetector& DetectorServer::addTenant(std::string name,
+                                                  std::string cfgPath)
+{
+    std::unique_ptr<Tenant> tenant(new Tenant);
+    tenant->name = name;
+    tenant->detector.reset(new FacialLandmarkDetector(cfgPath));
+    tenant->stats = TenantStats();
+    tenant->stats.name = name;
+
+    auto& streams = tenant->detector->m_streams;
+    for (std::size_t i = 0; i < streams.size(); i++)
+    {
+        Source source;
+        source.tenant = tenant.get();
+        source.streamIndex = i;
+        source.sock = streams[i].sock;
+        tenant->sources.push_back(source);
+    }
+
+    // The sources must not move from now on, since the epoll set
+    // holds pointers to them.
+    for (Source& source : tenant->sources)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &source;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, source.sock, &ev) != 0)
+        {
+            throw std::runtime_error("Cannot add socket to epoll set");
+        }
+    }
+
+    FacialLandmarkDetector& detector = *tenant->detector;
+
+    std::lock_guard<std::mutex> lock(m_tenantsMutex);
+    m_tenants.push_back(std::move(tenant));
+
+    return detector;
+}
+
+void DetectorServer::start(void)
+{
+    if (!m_workers.empty())
+    {
+        throw std::runtime_error("Server already started");
+    }
+
+    m_stop = false;
+    for (unsigned int i = 0; i < m_numWorkers; i++)
+    {
+        m_workers.push_back(std::thread(&DetectorServer::workerLoop, this, i));
+    }
+}
+
+void DetectorServer::stop(void)
+{
+    m_stop = true;
+    for (auto& worker : m_workers)
+    {
+        worker.join();
+    }
+    m_workers.clear();
+}
+
+unsigned int DetectorServer::numWorkers(void) const
+{
+    return m_numWorkers;
+}
+
+std::vector<DetectorServer::TenantStats> DetectorServer::getTenantStats(void) const
+{
+    std::vector<TenantStats> allStats;
+
+    std::lock_guard<std::mutex> lock(m_tenantsMutex);
+    for (const auto& tenant : m_tenants)
+    {
+        std::lock_guard<std::mutex> tenantLock(tenant->mutex);
+        allStats.push_back(tenant->stats);
+    }
+
+    return allStats;
+}
+
+void DetectorServer::workerLoop(unsigned int workerIndex)
+{
+    WorkQueue& queue = m_queues[workerIndex];
+
+    while (!m_stop)
+    {
+        Source *source = popWork(workerIndex);
+        if (source)
+        {
+            serviceSource(source);
+            continue;
+        }
+
+        // Nothing queued anywhere, so take a batch of ready sockets
+        // from the shared epoll set.
+        struct epoll_event events[WorkQueue::capacity];
+        int n = epoll_wait(m_epollFd, events, WorkQueue::capacity,
+                           epollTimeoutMs);
+        if (n <= 0)
+        {
+            continue;
+        }
+
+        int numQueued = 0;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for (int i = 0; i < n; i++)
+            {
+                Source *ready = static_cast<Source *>(events[i].data.ptr);
+                if (!ready)
+                {
+                    // Woken up to steal work; take one wakeup off the count
+                    std::uint64_t count;
+                    if (read(m_wakeFd, &count, sizeof count) < 0)
+                    {
+                        // Another worker took the last one
+                    }
+                    continue;
+                }
+
+                // Only this worker fills its own queue, and only when it
+                // is empty, so there is always room for a full batch.
+                int tail = (queue.head + queue.size) % WorkQueue::capacity;
+                queue.items[tail] = ready;
+                queue.size++;
+                numQueued++;
+            }
+        }
+
+        // Other workers stay asleep in epoll_wait() while the sockets
+        // they could take sit in our queue, so wake one for each socket
+        // beyond the one we will service next.
+        if (numQueued > 1)
+        {
+            std::uint64_t count = numQueued - 1;
+            if (write(m_wakeFd, &count, sizeof count) < 0)
+            {
+                // Only fails if the count would overflow
+            }
+        }
+    }
+}
+
+DetectorServer::Source *DetectorServer::popWork(unsigned int workerIndex)
+{
+    // Take from the front of our own queue...
+    {
+        WorkQueue& queue = m_queues[workerIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.size > 0)
+        {
+            Source *source = queue.items[queue.head];
+            queue.head = (queue.head + 1) % WorkQueue::capacity;
+            queue.size--;
+            return source;
+        }
+    }
+
+    // ... or steal from the back of someone else's.
+    for (unsigned int i = 1; i < m_numWorkers; i++)
+    {
+        WorkQueue& victim = m_queues[(workerIndex + i) % m_numWorkers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.size > 0)
+        {
+            victim.size--;
+            int tail = (victim.head + victim.size) % WorkQueue::capacity;
+            return victim.items[tail];
+        }
+    }
+
+    return nullptr;
+}
+
+void DetectorServer::serviceSource(Source *source)
+{
+    Tenant *tenant = source->tenant;
+
+    {
+        std::lock_guard<std::mutex> lock(tenant->mutex);
+
+        for (int i = 0; i < maxPacketsPerService; i++)
+        {
+            auto startTime = std::chrono::steady_clock::now();
+
+            auto result = tenant->detector->receivePacket(source->streamIndex,
+                                                          MSG_DONTWAIT);
+            if (result == FacialLandmarkDetector::RECV_NOTHING)
+            {
+                break;
+            }
+
+            tenant->stats.numPackets++;
+            if (result == FacialLandmarkDetector::RECV_IGNORED)
+            {
+                tenant->stats.numIgnored++;
+                continue;
+            }
+
+            std::uint64_t frameNs =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - startTime).count();
+            tenant->stats.numFrames++;
+            tenant->stats.busyNs += frameNs;
+            if (frameNs > tenant->stats.maxFrameNs)
+            {
+                tenant->stats.maxFrameNs = frameNs;
+            }
+        }
+    }
+
+    rearm(source);
+}
+
+void DetectorServer::rearm(Source *source)
+{
+    // The socket was registered with EPOLLONESHOT so that only one worker
+    // handles it at a time. Enable it again now that we are done.
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = source;
+    epoll_ctl(m_epollFd, EPOLL_CTL_MOD, source->sock, &ev);
+}
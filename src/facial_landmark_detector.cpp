@@ -25,9 +25,16 @@ SOFTWARE.
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <future>
+#include <iterator>
+#include <limits>
 
 #include <cstdint>
 #include <cinttypes>
+#include <cstring>
 #ifdef _WIN32
 #   include <WinSock2.h>
 #   include <ws2tcpip.h>
@@ -35,317 +42,2072 @@ SOFTWARE.
 #else
 #   include <sys/types.h>
 #   include <sys/socket.h>
+#   include <sys/time.h>
 #   include <arpa/inet.h>
+#   include <net/if.h>
+#   include <netdb.h>
+#   include <netinet/in.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
 #   include <unistd.h>
 #endif
 
+#ifdef __linux__
+#   include <pthread.h>
+#   include <sched.h>
+#   include <sys/resource.h>
+#   include <sys/syscall.h>
+#   include <sys/uio.h>
+#   include <time.h>
+#   include <cerrno>
+#endif
+
 #include "facial_landmark_detector.h"
 #include "math_utils.h"
+#include "param_codec.h"
+
+
+static const int recvTimeoutMs = 100;
+
+// Layout of the UDP packets sent by OSF
+static const int nPoints = FacialLandmarkDetector::numLandmarks;
+static const int packetFrameSize = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                 + 4 * 4 + 4 * 68 + 4 * 2 * 68 + 4 * 3 * 70 + 4 * 14;
+
+static const int timestampOffset = 0;
+
+static const int confidenceOffset = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                  + 4 * 4;
+
+static const int landmarksOffset = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                 + 4 * 4 + 4 * 68;
 
+// OSF's own features, at the end of the packet
+static const int osfFeaturesOffset = packetFrameSize - 4 * 14;
 
-static void filterPush(std::deque<double>& buf, double newval,
-                       std::size_t numTaps)
+enum OsfFeature
 {
-    buf.push_back(newval);
-    while (buf.size() > numTaps)
-    {
-        buf.pop_front();
-    }
+    OSF_EYE_L,
+    OSF_EYE_R,
+    OSF_EYEBROW_STEEPNESS_L,
+    OSF_EYEBROW_UPDOWN_L,
+    OSF_EYEBROW_QUIRK_L,
+    OSF_EYEBROW_STEEPNESS_R,
+    OSF_EYEBROW_UPDOWN_R,
+    OSF_EYEBROW_QUIRK_R,
+    OSF_MOUTH_CORNER_UPDOWN_L,
+    OSF_MOUTH_CORNER_INOUT_L,
+    OSF_MOUTH_CORNER_UPDOWN_R,
+    OSF_MOUTH_CORNER_INOUT_R,
+    OSF_MOUTH_OPEN,
+    OSF_MOUTH_WIDE
+};
+
+static double osfFeature(const char *buf, OsfFeature feature)
+{
+    return *(float *)(buf + osfFeaturesOffset + feature * sizeof(float));
 }
 
-FacialLandmarkDetector::FacialLandmarkDetector(std::string cfgPath)
-    : m_stop(false)
+// Lower bound on the weight of a stream whose X angle is saturated
+static const double minViewWeight = 0.05;
+
+#ifdef __linux__
+// Same clock as the kernel receive timestamps (SO_TIMESTAMPNS)
+static std::uint64_t realtimeNs(void)
 {
-    parseConfig(cfgPath);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+#endif
 
-#ifdef _WIN32 // WinSock2 should be initialized before using
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+FacialLandmarkDetector::MovingAverage::MovingAverage(void)
+    : m_next(0), m_size(0)
+{
+}
+
+void FacialLandmarkDetector::MovingAverage::setNumTaps(std::size_t numTaps)
+{
+    m_buf.assign(numTaps, 0);
+    m_next = 0;
+    m_size = 0;
+}
+
+void FacialLandmarkDetector::MovingAverage::push(double newval)
+{
+    if (m_buf.empty())
     {
         return;
     }
-#endif
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(m_cfg.osfPort);
-    addr.sin_addr.s_addr = inet_addr(m_cfg.osfIpAddress.c_str());
+    m_buf[m_next] = newval;
+    m_next = (m_next + 1) % m_buf.size();
+    if (m_size < m_buf.size())
+    {
+        m_size++;
+    }
+}
 
-    m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (m_sock < 0)
+double FacialLandmarkDetector::MovingAverage::avg(double defaultValue) const
+{
+    if (m_size == 0)
     {
-        throw std::runtime_error("Cannot create UDP socket");
+        return defaultValue;
     }
 
-    int ret = bind(m_sock, (struct sockaddr *)&addr, sizeof addr);
-    if (ret != 0)
+    // Sum from the oldest value to the newest
+    std::size_t i = (m_next + m_buf.size() - m_size) % m_buf.size();
+    double sum = 0;
+    for (std::size_t n = 0; n < m_size; n++)
     {
-        throw std::runtime_error("Cannot bind socket");
+        sum += m_buf[i];
+        i = (i + 1) % m_buf.size();
     }
+    return sum / m_size;
 }
 
-FacialLandmarkDetector::~FacialLandmarkDetector()
+void FacialLandmarkDetector::MovingAverage::getValues(std::vector<double>& values) const
 {
-#ifdef _WIN32
-    closesocket(m_sock);
-#else
-    close(m_sock);
-#endif
+    values.clear();
+    std::size_t i = m_buf.empty() ? 0 : (m_next + m_buf.size() - m_size) % m_buf.size();
+    for (std::size_t n = 0; n < m_size; n++)
+    {
+        values.push_back(m_buf[i]);
+        i = (i + 1) % m_buf.size();
+    }
 }
 
-FacialLandmarkDetector::Params FacialLandmarkDetector::getParams(void) const
+FacialLandmarkDetector::QualityMeter::QualityMeter(void)
+    : m_window(1), m_low(-std::numeric_limits<double>::infinity()),
+      m_high(std::numeric_limits<double>::infinity()), m_numFrames(0),
+      m_raw(), m_next(0), m_filtered(), m_jitter(0), m_rawJitter(0),
+      m_lagError(), m_saturatedLow(0), m_saturatedHigh(0)
 {
-    Params params;
+}
 
-    params.faceXAngle = avg(m_faceXAngle);
-    params.faceYAngle = avg(m_faceYAngle) + m_cfg.faceYAngleCorrection;
-    // + 10 correct for angle between computer monitor and webcam
-    params.faceZAngle = avg(m_faceZAngle);
-    params.mouthOpenness = avg(m_mouthOpenness);
-    params.mouthForm = avg(m_mouthForm);
+void FacialLandmarkDetector::QualityMeter::setWindow(double numFrames)
+{
+    m_window = std::max(numFrames, 1.0);
+}
 
-    double leftEye = avg(m_leftEyeOpenness, 1);
-    double rightEye = avg(m_rightEyeOpenness, 1);
-    bool sync = !m_cfg.winkEnable;
+void FacialLandmarkDetector::QualityMeter::setLimits(double low, double high)
+{
+    m_low = low;
+    m_high = high;
+}
 
-    if (m_cfg.winkEnable)
+void FacialLandmarkDetector::QualityMeter::update(double raw, double filtered)
+{
+    m_numFrames++;
+
+    // A plain mean until the window is full, then exponentially weighted
+    // with a time constant of m_window frames
+    double alpha = 1 / std::min(static_cast<double>(m_numFrames), m_window);
+
+    m_saturatedLow += alpha * ((raw <= m_low ? 1 : 0) - m_saturatedLow);
+    m_saturatedHigh += alpha * ((raw >= m_high ? 1 : 0) - m_saturatedHigh);
+
+    const int ringSize = maxLag + 1;
+    double prevRaw = m_raw[(m_next + ringSize - 1) % ringSize];
+    double prevRaw2 = m_raw[(m_next + ringSize - 2) % ringSize];
+    m_raw[m_next] = raw;
+
+    if (m_numFrames >= 3)
     {
-        if (rightEye < 0.1 && leftEye > 0.2)
-        {
-            leftEye = 1;
-            rightEye = 0;
-        }
-        else if (leftEye < 0.1 && rightEye > 0.2)
-        {
-            leftEye = 0;
-            rightEye = 1;
-        }
-        else
-        {
-            sync = true;
-        }
+        double d2 = filtered - 2 * m_filtered[0] + m_filtered[1];
+        double rawD2 = raw - 2 * prevRaw + prevRaw2;
+        m_jitter += alpha * (d2 * d2 - m_jitter);
+        m_rawJitter += alpha * (rawD2 * rawD2 - m_rawJitter);
     }
 
-    if (sync)
+    // Squared error between the output and the raw value lag frames ago.
+    // Lags not yet covered by the history are averaged from when they are.
+    for (int lag = 0; lag <= maxLag && static_cast<std::uint64_t>(lag) < m_numFrames; lag++)
     {
-        // Combine the two to get better synchronized blinks
-        double bothEyes = (leftEye + rightEye) / 2;
-        leftEye = bothEyes;
-        rightEye = bothEyes;
+        double e = filtered - m_raw[(m_next + ringSize - lag) % ringSize];
+        double a = 1 / std::min(static_cast<double>(m_numFrames - lag), m_window);
+        m_lagError[lag] += a * (e * e - m_lagError[lag]);
     }
 
-    params.leftEyeOpenness = leftEye;
-    params.rightEyeOpenness = rightEye;
+    m_next = (m_next + 1) % ringSize;
+    m_filtered[1] = m_filtered[0];
+    m_filtered[0] = filtered;
+}
 
-    if (leftEye <= m_cfg.eyeSmileEyeOpenThreshold &&
-        rightEye <= m_cfg.eyeSmileEyeOpenThreshold &&
-        params.mouthForm > m_cfg.eyeSmileMouthFormThreshold &&
-        params.mouthOpenness > m_cfg.eyeSmileMouthOpenThreshold)
+FacialLandmarkDetector::QualityStats FacialLandmarkDetector::QualityMeter::stats(void) const
+{
+    QualityStats stats = {};
+    stats.numFrames = m_numFrames;
+    stats.jitter = m_jitter;
+    stats.rawJitter = m_rawJitter;
+    stats.saturatedLow = m_saturatedLow;
+    stats.saturatedHigh = m_saturatedHigh;
+
+    int numLags = static_cast<int>(std::min<std::uint64_t>(m_numFrames, maxLag + 1));
+    if (numLags == 0)
     {
-        params.leftEyeSmile = 1;
-        params.rightEyeSmile = 1;
+        return stats;
     }
-    else
+
+    // Best matching lag, refined with a parabola through its neighbours
+    // (as in filter_tuner)
+    int best = static_cast<int>(std::min_element(m_lagError, m_lagError + numLags)
+                                - m_lagError);
+    stats.lag = best;
+    if (best > 0 && best < numLags - 1)
     {
-        params.leftEyeSmile = 0;
-        params.rightEyeSmile = 0;
+        double a = m_lagError[best - 1], b = m_lagError[best], c = m_lagError[best + 1];
+        double denom = a - 2 * b + c;
+        if (denom > 0)
+        {
+            stats.lag += 0.5 * (a - c) / denom;
+        }
     }
+    return stats;
+}
 
-    params.autoBlink = m_cfg.autoBlink;
-    params.autoBreath = m_cfg.autoBreath;
-    params.randomMotion = m_cfg.randomMotion;
+const std::size_t FacialLandmarkDetector::maxBindings;
+
+const std::size_t FacialLandmarkDetector::osfPacketSize = packetFrameSize;
+const int FacialLandmarkDetector::numLandmarks;
+
+// Names of the parameters in Params, in ParamIndex order
+static const char *const paramNames[] = {
+    "leftEyeOpenness",
+    "rightEyeOpenness",
+    "leftEyeSmile",
+    "rightEyeSmile",
+    "mouthOpenness",
+    "mouthForm",
+    "faceXAngle",
+    "faceYAngle",
+    "faceZAngle",
+    "leftEyebrowUpDown",
+    "rightEyebrowUpDown",
+    "leftEyebrowAngle",
+    "rightEyebrowAngle",
+};
+
+FacialLandmarkDetector::SlidingMedian::SlidingMedian(void)
+    : m_numTaps(0), m_count(0), m_next(0), m_hampelThreshold(0)
+{
+}
 
-    return params;
+void FacialLandmarkDetector::SlidingMedian::setNumTaps(std::size_t numTaps,
+                                                       double hampelThreshold)
+{
+    m_numTaps = static_cast<int>(numTaps);
+    m_count = 0;
+    m_next = 0;
+    m_hampelThreshold = hampelThreshold;
+
+    m_data.assign(numTaps, 0);
+    m_pos.assign(numTaps, 0);
+    m_heap.assign(numTaps, 0);
+    m_deviations.assign(numTaps, 0);
+
+    // Hand out heap slots alternately to the median, the max-heap
+    // and the min-heap: 0, -1, 1, -2, 2, ...
+    for (int i = 0; i < m_numTaps; i++)
+    {
+        m_pos[i] = ((i + 1) / 2) * ((i & 1) ? -1 : 1);
+        heap(m_pos[i]) = i;
+    }
 }
 
-void FacialLandmarkDetector::stop(void)
+int& FacialLandmarkDetector::SlidingMedian::heap(int i)
 {
-    m_stop = true;
+    return m_heap[i + m_numTaps / 2];
 }
 
-void FacialLandmarkDetector::mainLoop(void)
+int FacialLandmarkDetector::SlidingMedian::minCount(void) const
 {
-    while (!m_stop)
-    {
-        // Read UDP packet from OSF
-        static const int nPoints = 68;
-        static const int packetFrameSize = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
-                                         + 4 * 4 + 4 * 68 + 4 * 2 * 68 + 4 * 3 * 70 + 4 * 14;
+    return (m_count - 1) / 2;
+}
 
-        static const int landmarksOffset = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
-                                         + 4 * 4 + 4 * 68;
+int FacialLandmarkDetector::SlidingMedian::maxCount(void) const
+{
+    return m_count / 2;
+}
 
-        char buf[packetFrameSize];
-        auto recvSize = recv(m_sock, buf, sizeof buf, 0);
+bool FacialLandmarkDetector::SlidingMedian::less(int i, int j) const
+{
+    return m_data[m_heap[i + m_numTaps / 2]] < m_data[m_heap[j + m_numTaps / 2]];
+}
 
-        if (recvSize != packetFrameSize) continue;
-        // Note: This is dependent on endianness, and we would assume that
-        // the OSF instance is run on a machine with the same endianness
-        // as our current machine.
-        int recvFaceId = *(int *)(buf + 8);
-        if (recvFaceId != m_faceId) continue; // We only support one face
+bool FacialLandmarkDetector::SlidingMedian::compareExchange(int i, int j)
+{
+    // Swap heap slots i and j if the value at i is less than that at j
+    if (!less(i, j))
+    {
+        return false;
+    }
 
-        Point landmarks[nPoints];
+    std::swap(heap(i), heap(j));
+    m_pos[heap(i)] = i;
+    m_pos[heap(j)] = j;
+    return true;
+}
 
-        for (int i = 0; i < nPoints; i++)
+void FacialLandmarkDetector::SlidingMedian::minSortDown(int i)
+{
+    for (; i <= minCount(); i *= 2)
+    {
+        if (i > 1 && i < minCount() && less(i + 1, i))
         {
-            float x = *(float *)(buf + landmarksOffset + i * 2 * sizeof(float));
-            float y = *(float *)(buf + landmarksOffset + (i * 2 + 1) * sizeof(float));
-
-            landmarks[i].x = x;
-            landmarks[i].y = y;
+            i++;
+        }
+        if (!compareExchange(i, i / 2))
+        {
+            break;
         }
-
-        /* The coordinates seem to be rather noisy in general.
-         * We will push everything through some moving average filters
-         * to reduce noise. The number of taps is determined empirically
-         * until we get something good.
-         * An alternative method would be to get some better dataset -
-         * perhaps even to train on a custom data set just for the user.
-         */
-
-        // Face rotation: X direction (left-right)
-        double faceXRot = calcFaceXAngle(landmarks);
-        filterPush(m_faceXAngle, faceXRot, m_cfg.faceXAngleNumTaps);
-
-        // Mouth form (smile / laugh) detection
-        double mouthForm = calcMouthForm(landmarks);
-        filterPush(m_mouthForm, mouthForm, m_cfg.mouthFormNumTaps);
-
-        // Face rotation: Y direction (up-down)
-        double faceYRot = calcFaceYAngle(landmarks, faceXRot, mouthForm);
-        filterPush(m_faceYAngle, faceYRot, m_cfg.faceYAngleNumTaps);
-
-        // Face rotation: Z direction (head tilt)
-        double faceZRot = calcFaceZAngle(landmarks);
-        filterPush(m_faceZAngle, faceZRot, m_cfg.faceZAngleNumTaps);
-
-        // Mouth openness
-        double mouthOpen = calcMouthOpenness(landmarks, mouthForm);
-        filterPush(m_mouthOpenness, mouthOpen, m_cfg.mouthOpenNumTaps);
-
-        // Eye openness
-        double eyeLeftOpen = calcEyeOpenness(LEFT, landmarks, faceYRot);
-        filterPush(m_leftEyeOpenness, eyeLeftOpen, m_cfg.leftEyeOpenNumTaps);
-        double eyeRightOpen = calcEyeOpenness(RIGHT, landmarks, faceYRot);
-        filterPush(m_rightEyeOpenness, eyeRightOpen, m_cfg.rightEyeOpenNumTaps);
-
-        // Eyebrows: the landmark detection doesn't work very well for my face,
-        // so I've not implemented them.
     }
 }
 
-double FacialLandmarkDetector::calcEyeAspectRatio(
-    Point& p1, Point& p2,
-    Point& p3, Point& p4,
-    Point& p5, Point& p6) const
+void FacialLandmarkDetector::SlidingMedian::maxSortDown(int i)
 {
-    double eyeWidth = dist(p1, p4);
-    double eyeHeight1 = dist(p2, p6);
-    double eyeHeight2 = dist(p3, p5);
-
-    return (eyeHeight1 + eyeHeight2) / (2 * eyeWidth);
+    for (; i >= -maxCount(); i *= 2)
+    {
+        if (i < -1 && i > -maxCount() && less(i, i - 1))
+        {
+            i--;
+        }
+        if (!compareExchange(i / 2, i))
+        {
+            break;
+        }
+    }
 }
 
-double FacialLandmarkDetector::calcEyeOpenness(
-    LeftRight eye,
-    Point landmarks[],
-    double faceYAngle) const
+bool FacialLandmarkDetector::SlidingMedian::minSortUp(int i)
 {
-    double eyeAspectRatio;
-    if (eye == LEFT)
+    while (i > 0 && compareExchange(i, i / 2))
     {
-        eyeAspectRatio = calcEyeAspectRatio(landmarks[42], landmarks[43], landmarks[44],
-                                            landmarks[45], landmarks[46], landmarks[47]);
+        i /= 2;
     }
-    else
+    return i == 0;
+}
+
+bool FacialLandmarkDetector::SlidingMedian::maxSortUp(int i)
+{
+    while (i < 0 && compareExchange(i / 2, i))
     {
-        eyeAspectRatio = calcEyeAspectRatio(landmarks[36], landmarks[37], landmarks[38],
-                                            landmarks[39], landmarks[40], landmarks[41]);
+        i /= 2;
     }
-
-    // Apply correction due to faceYAngle
-    double corrEyeAspRat = eyeAspectRatio / std::cos(degToRad(faceYAngle));
-
-    return linearScale01(corrEyeAspRat, m_cfg.eyeClosedThreshold, m_cfg.eyeOpenThreshold);
+    return i == 0;
 }
 
-
-
-double FacialLandmarkDetector::calcMouthForm(Point landmarks[]) const
+double FacialLandmarkDetector::SlidingMedian::median(void) const
 {
-    /* Mouth form parameter: 0 for normal mouth, 1 for fully smiling / laughing.
-     * Compare distance between the two corners of the mouth
-     * to the distance between the two eyes.
-     */
-
-    /* An alternative (my initial attempt) was to compare the corners of
-     * the mouth to the top of the upper lip - they almost lie on a
-     * straight line when smiling / laughing. But that is only true
-     * when facing straight at the camera. When looking up / down,
-     * the angle changes. So here we'll use the distance approach instead.
-     */
-
-    auto eye1 = centroid(landmarks[36], landmarks[37], landmarks[38],
-                         landmarks[39], landmarks[40], landmarks[41]);
-    auto eye2 = centroid(landmarks[42], landmarks[43], landmarks[44],
-                         landmarks[45], landmarks[46], landmarks[47]);
-    double distEyes = dist(eye1, eye2);
-    double distMouth = dist(landmarks[58], landmarks[62]);
-
-    double form = linearScale01(distMouth / distEyes,
-                                m_cfg.mouthNormalThreshold,
-                                m_cfg.mouthSmileThreshold);
+    double med = m_data[m_heap[m_numTaps / 2]];
+    if ((m_count & 1) == 0)
+    {
+        med = (med + m_data[m_heap[m_numTaps / 2 - 1]]) / 2;
+    }
+    return med;
+}
 
-    return form;
+void FacialLandmarkDetector::SlidingMedian::getValues(std::vector<double>& values) const
+{
+    values.clear();
+    int i = m_numTaps == 0 ? 0 : (m_next + m_numTaps - m_count) % m_numTaps;
+    for (int n = 0; n < m_count; n++)
+    {
+        values.push_back(m_data[i]);
+        i = (i + 1) % m_numTaps;
+    }
 }
 
-double FacialLandmarkDetector::calcMouthOpenness(
-    Point landmarks[],
-    double mouthForm) const
+double FacialLandmarkDetector::SlidingMedian::filter(double newval)
 {
-    // Use points for the bottom of the upper lip, and top of the lower lip
-    // We have 3 pairs of points available, which give the mouth height
-    // on the left, in the middle, and on the right, resp.
-    // First let's try to use an average of all three.
-    double heightLeft   = dist(landmarks[61], landmarks[63]);
-    double heightMiddle = dist(landmarks[60], landmarks[64]);
-    double heightRight  = dist(landmarks[59], landmarks[65]);
+    if (m_numTaps == 0)
+    {
+        return newval;
+    }
 
-    double avgHeight = (heightLeft + heightMiddle + heightRight) / 3;
+    // Overwrite the oldest value, then restore the heap properties
+    // starting from the slot it was in.
+    bool isNew = m_count < m_numTaps;
+    int p = m_pos[m_next];
+    double old = m_data[m_next];
+    m_data[m_next] = newval;
+    m_next = (m_next + 1) % m_numTaps;
+    if (isNew)
+    {
+        m_count++;
+    }
 
-    // Now, normalize it with the width of the mouth.
-    double width = dist(landmarks[58], landmarks[62]);
+    if (p > 0) // In the min-heap
+    {
+        if (!isNew && old < newval)
+        {
+            minSortDown(p * 2);
+        }
+        else if (minSortUp(p))
+        {
+            maxSortDown(-1);
+        }
+    }
+    else if (p < 0) // In the max-heap
+    {
+        if (!isNew && newval < old)
+        {
+            maxSortDown(p * 2);
+        }
+        else if (maxSortUp(p))
+        {
+            minSortDown(1);
+        }
+    }
+    else // At the median
+    {
+        if (maxCount() > 0)
+        {
+            maxSortDown(-1);
+        }
+        if (minCount() > 0)
+        {
+            minSortDown(1);
+        }
+    }
 
-    double normalized = avgHeight / width;
+    double med = median();
 
-    double scaled = linearScale01(normalized,
-                                  m_cfg.mouthClosedThreshold,
-                                  m_cfg.mouthOpenThreshold,
-                                  true, false);
+    if (m_hampelThreshold <= 0)
+    {
+        return med;
+    }
 
-    // Apply correction according to mouthForm
-    // Notice that when you smile / laugh, width is increased
-    scaled *= (1 + m_cfg.mouthOpenLaughCorrection * mouthForm);
+    // Median absolute deviation. This is O(n) (see the class comment),
+    // but only needs a partial sort of the deviations, in preallocated
+    // scratch space.
+    std::size_t n = static_cast<std::size_t>(m_count);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        m_deviations[i] = std::abs(m_data[i] - med);
+    }
+    std::nth_element(m_deviations.begin(), m_deviations.begin() + n / 2,
+                     m_deviations.begin() + n);
+    double mad = m_deviations[n / 2];
 
-    return scaled;
+    // 1.4826 * MAD estimates the standard deviation for normal noise
+    if (std::abs(newval - med) > m_hampelThreshold * 1.4826 * mad)
+    {
+        return med;
+    }
+    return newval;
 }
 
-double FacialLandmarkDetector::calcFaceXAngle(Point landmarks[]) const
+/*! Parse a list of CPUs such as "0,2-3" */
+static bool parseCpuList(const std::string& list, std::vector<int>& cpus)
 {
-    // This function will be easier to understand if you refer to the
-    // diagram in faceXAngle.png
+    cpus.clear();
 
-    // Construct the y-axis using (1) average of four points on the nose and
-    // (2) average of five points on the upper lip.
+    std::istringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        int first, last;
+        char dash;
+        std::istringstream itemSs(item);
+        if (!(itemSs >> first) || first < 0)
+        {
+            return false;
+        }
+        last = first;
+        if (itemSs >> dash)
+        {
+            if (dash != '-' || !(itemSs >> last) || last < first)
+            {
+                return false;
+            }
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
 
-    auto y0 = centroid(landmarks[27], landmarks[28], landmarks[29],
-                       landmarks[30]);
-    auto y1 = centroid(landmarks[48], landmarks[49], landmarks[50],
-                       landmarks[51], landmarks[52]);
+    return !cpus.empty();
+}
 
-    // Now drop a perpedicular from the left and right edges of the face,
-    // and calculate the ratio between the lengths of these perpendiculars
+FacialLandmarkDetector::FacialLandmarkDetector(std::string cfgPath,
+                                               InputMode inputMode,
+                                               std::string cfgOverrides)
+    : m_stop(false), m_threadId(0), m_numFrames(0), m_numSkippedFrames(0),
+      m_numTimestampedFrames(0), m_queueDelayNs(0), m_maxQueueDelayNs(0),
+      m_latencyNs(0), m_numKernelDrops(0), m_inputMode(inputMode),
+      m_rebroadcastSock(-1), m_rebroadcastSequence(0),
+      m_rebroadcastSinceKeyframe(0), m_rebroadcastQuantized(),
+      m_qualityDumpPending(false), m_qualityDumpStop(false)
+{
+    parseConfig(cfgPath, cfgOverrides);
+
+    m_faceXAngle.setNumTaps(m_cfg.faceXAngleNumTaps);
+    m_faceYAngle.setNumTaps(m_cfg.faceYAngleNumTaps);
+    m_faceZAngle.setNumTaps(m_cfg.faceZAngleNumTaps);
+    m_mouthForm.setNumTaps(m_cfg.mouthFormNumTaps);
+    m_mouthOpenness.setNumTaps(m_cfg.mouthOpenNumTaps);
+    m_leftEyeOpenness.setNumTaps(m_cfg.leftEyeOpenNumTaps);
+    m_rightEyeOpenness.setNumTaps(m_cfg.rightEyeOpenNumTaps);
+    m_leftEyebrowUpDown.setNumTaps(m_cfg.eyebrowNumTaps);
+    m_rightEyebrowUpDown.setNumTaps(m_cfg.eyebrowNumTaps);
+    m_leftEyebrowAngle.setNumTaps(m_cfg.eyebrowNumTaps);
+    m_rightEyebrowAngle.setNumTaps(m_cfg.eyebrowNumTaps);
+
+    m_faceXAngleMedian.setNumTaps(m_cfg.faceXAngleMedianTaps,
+                                  m_cfg.faceXAngleHampelThreshold);
+    m_faceYAngleMedian.setNumTaps(m_cfg.faceYAngleMedianTaps,
+                                  m_cfg.faceYAngleHampelThreshold);
+    m_faceZAngleMedian.setNumTaps(m_cfg.faceZAngleMedianTaps,
+                                  m_cfg.faceZAngleHampelThreshold);
+    m_mouthFormMedian.setNumTaps(m_cfg.mouthFormMedianTaps,
+                                 m_cfg.mouthFormHampelThreshold);
+    m_mouthOpennessMedian.setNumTaps(m_cfg.mouthOpenMedianTaps,
+                                     m_cfg.mouthOpenHampelThreshold);
+    m_leftEyeOpennessMedian.setNumTaps(m_cfg.leftEyeOpenMedianTaps,
+                                       m_cfg.leftEyeOpenHampelThreshold);
+    m_rightEyeOpennessMedian.setNumTaps(m_cfg.rightEyeOpenMedianTaps,
+                                        m_cfg.rightEyeOpenHampelThreshold);
+    m_leftEyebrowUpDownMedian.setNumTaps(m_cfg.eyebrowMedianTaps,
+                                         m_cfg.eyebrowHampelThreshold);
+    m_rightEyebrowUpDownMedian.setNumTaps(m_cfg.eyebrowMedianTaps,
+                                          m_cfg.eyebrowHampelThreshold);
+    m_leftEyebrowAngleMedian.setNumTaps(m_cfg.eyebrowMedianTaps,
+                                        m_cfg.eyebrowHampelThreshold);
+    m_rightEyebrowAngleMedian.setNumTaps(m_cfg.eyebrowMedianTaps,
+                                         m_cfg.eyebrowHampelThreshold);
+
+    // The limits of each feature before filtering, to measure how often
+    // they are reached
+    const double inf = std::numeric_limits<double>::infinity();
+    for (QualityMeter& meter : m_quality)
+    {
+        meter.setWindow(m_cfg.qualityWindow);
+    }
+    m_quality[PARAM_FACE_X_ANGLE].setLimits(-30, 30);
+    m_quality[PARAM_FACE_Y_ANGLE].setLimits(-30, 30);
+    m_quality[PARAM_MOUTH_FORM].setLimits(0, 1);
+    m_quality[PARAM_MOUTH_OPENNESS].setLimits(
+        0, m_cfg.featureSource == FEATURES_OSF ? 1 : inf);
+    m_quality[PARAM_LEFT_EYE_OPENNESS].setLimits(0, 1);
+    m_quality[PARAM_RIGHT_EYE_OPENNESS].setLimits(0, 1);
+    m_quality[PARAM_LEFT_EYEBROW_UP_DOWN].setLimits(-1, 1);
+    m_quality[PARAM_RIGHT_EYEBROW_UP_DOWN].setLimits(-1, 1);
+    m_quality[PARAM_LEFT_EYEBROW_ANGLE].setLimits(-1, 1);
+    m_quality[PARAM_RIGHT_EYEBROW_ANGLE].setLimits(-1, 1);
+    m_nextQualityDump = std::chrono::steady_clock::now();
+
+    if (m_inputMode == INPUT_OFFLINE)
+    {
+        // Streams without sockets, to be fed through processPacket()
+        m_streams.push_back(Stream(-1, 0));
+        for (const auto& extra : m_cfg.osfExtraStreams)
+        {
+            m_streams.push_back(Stream(-1, extra.yawOffset));
+        }
+        return;
+    }
+
+#ifdef _WIN32 // WinSock2 should be initialized before using
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        return;
+    }
+#endif
+
+    // Reserved up front, so that a socket is never left open by a
+    // failing push_back
+    m_streams.reserve(1 + m_cfg.osfExtraStreams.size());
+    try
+    {
+        m_streams.push_back(Stream(openSocket(m_cfg.osfPort), 0));
+        for (const auto& extra : m_cfg.osfExtraStreams)
+        {
+            m_streams.push_back(Stream(openSocket(extra.port), extra.yawOffset));
+        }
+
+        if (!m_cfg.rebroadcastAddress.empty())
+        {
+            openRebroadcastSocket();
+        }
+    }
+    catch (...)
+    {
+        // The destructor does not run if the constructor throws
+        for (const Stream& stream : m_streams)
+        {
+            closeSocket(stream.sock);
+        }
+        m_streams.clear();
+        throw;
+    }
+
+    // Not for offline detectors, whose output should only depend on
+    // the packets fed to them
+    if (!m_cfg.stateFile.empty())
+    {
+        restoreState();
+    }
+
+    // Last, since nothing may throw once the thread is running
+    if (!m_cfg.qualityDumpPath.empty())
+    {
+        m_qualityDumpThread = std::thread(&FacialLandmarkDetector::qualityDumpLoop, this);
+    }
+}
+
+/*! Join the multicast group on osfMulticastInterface, or the default one */
+static void joinMulticastGroup(int sock, const struct sockaddr_storage& group,
+                               const std::string& iface)
+{
+    int ret;
+
+    if (group.ss_family == AF_INET)
+    {
+        // The interface is given by one of its IPv4 addresses
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = ((const struct sockaddr_in *)&group)->sin_addr;
+        mreq.imr_interface.s_addr = iface.empty() ? htonl(INADDR_ANY)
+                                                  : inet_addr(iface.c_str());
+        ret = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                         (const char *)&mreq, sizeof mreq);
+    }
+    else
+    {
+        // The interface is given by its index, or name where supported
+        struct ipv6_mreq mreq;
+        mreq.ipv6mr_multiaddr = ((const struct sockaddr_in6 *)&group)->sin6_addr;
+        mreq.ipv6mr_interface = 0;
+        if (!iface.empty())
+        {
+            std::istringstream ss(iface);
+            if (!(ss >> mreq.ipv6mr_interface))
+            {
+#ifdef _WIN32
+                mreq.ipv6mr_interface = 0;
+#else
+                mreq.ipv6mr_interface = if_nametoindex(iface.c_str());
+#endif
+                if (mreq.ipv6mr_interface == 0)
+                {
+                    throw std::runtime_error("Unknown osfMulticastInterface: " + iface);
+                }
+            }
+        }
+        ret = setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+                         (const char *)&mreq, sizeof mreq);
+    }
+
+    if (ret != 0)
+    {
+        throw std::runtime_error("Cannot join multicast group");
+    }
+}
+
+int FacialLandmarkDetector::openSocket(int port)
+{
+    // osfIpAddress may be IPv4 or IPv6, unicast or multicast
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+    struct addrinfo *res;
+    if (getaddrinfo(m_cfg.osfIpAddress.c_str(), std::to_string(port).c_str(),
+                    &hints, &res) != 0)
+    {
+        throw std::runtime_error("Invalid osfIpAddress: " + m_cfg.osfIpAddress);
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addrLen = res->ai_addrlen;
+    std::memcpy(&addr, res->ai_addr, addrLen);
+    freeaddrinfo(res);
+
+    bool multicast;
+    if (addr.ss_family == AF_INET)
+    {
+        multicast = IN_MULTICAST(ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr));
+    }
+    else
+    {
+        multicast = IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&addr)->sin6_addr);
+    }
+
+    int sock = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        throw std::runtime_error("Cannot create UDP socket");
+    }
+
+    try
+    {
+        setSocketOptions(sock, multicast);
+    }
+    catch (...)
+    {
+        closeSocket(sock);
+        throw;
+    }
+
+#ifdef _WIN32
+    // Windows cannot bind to a multicast address; the group membership
+    // does the filtering instead
+    struct sockaddr_storage bindAddr = addr;
+    if (multicast && addr.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)&bindAddr)->sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    else if (multicast)
+    {
+        ((struct sockaddr_in6 *)&bindAddr)->sin6_addr = in6addr_any;
+    }
+    int ret = bind(sock, (struct sockaddr *)&bindAddr, addrLen);
+#else
+    int ret = bind(sock, (struct sockaddr *)&addr, addrLen);
+#endif
+    if (ret != 0)
+    {
+        closeSocket(sock);
+        std::ostringstream ss;
+        ss << "Cannot bind socket to port " << port;
+        throw std::runtime_error(ss.str());
+    }
+
+    if (multicast)
+    {
+        try
+        {
+            joinMulticastGroup(sock, addr, m_cfg.osfMulticastInterface);
+        }
+        catch (...)
+        {
+            closeSocket(sock);
+            throw;
+        }
+    }
+
+    return sock;
+}
+
+
+void FacialLandmarkDetector::setSocketOptions(int sock, bool multicast)
+{
+    int on = 1;
+
+    // Let every process on this machine that joins the group bind the
+    // same port, and get its own copy of each packet
+    if (multicast &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof on) != 0)
+    {
+        throw std::runtime_error("Cannot set SO_REUSEADDR");
+    }
+
+    if (m_cfg.osfReusePort)
+    {
+#ifdef SO_REUSEPORT
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) != 0)
+        {
+            throw std::runtime_error("Cannot set osfReusePort");
+        }
+#else
+        throw std::runtime_error("osfReusePort is not supported on this platform");
+#endif
+    }
+
+    if (m_cfg.osfRecvBufferSize > 0)
+    {
+        // Capped by the kernel (net.core.rmem_max on Linux)
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                       (const char *)&m_cfg.osfRecvBufferSize,
+                       sizeof m_cfg.osfRecvBufferSize) != 0)
+        {
+            throw std::runtime_error("Cannot set osfRecvBufferSize");
+        }
+    }
+
+#ifdef __linux__
+    if (m_cfg.osfBusyPoll > 0)
+    {
+        // Needs CAP_NET_ADMIN above net.core.busy_read
+        if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                       &m_cfg.osfBusyPoll, sizeof m_cfg.osfBusyPoll) != 0)
+        {
+            throw std::runtime_error(std::string("Cannot set osfBusyPoll: ") +
+                                     std::strerror(errno));
+        }
+    }
+
+    if (m_cfg.osfKernelTimestamps)
+    {
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on) != 0)
+        {
+            throw std::runtime_error("Cannot enable osfKernelTimestamps");
+        }
+    }
+
+    // Have the kernel report its drop counter with every packet. Not
+    // supported everywhere, and only used for statistics, so failure is
+    // fine.
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof on);
+#endif
+}
+
+void FacialLandmarkDetector::openRebroadcastSocket(void)
+{
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(m_cfg.rebroadcastPort);
+    addr.sin_addr.s_addr = inet_addr(m_cfg.rebroadcastAddress.c_str());
+
+    m_rebroadcastSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_rebroadcastSock < 0)
+    {
+        throw std::runtime_error("Cannot create UDP socket");
+    }
+
+    // Connect so that each frame is a single send() without an address
+    int ret = connect(m_rebroadcastSock, (struct sockaddr *)&addr, sizeof addr);
+    if (ret != 0)
+    {
+        closeSocket(m_rebroadcastSock);
+        m_rebroadcastSock = -1;
+        throw std::runtime_error("Cannot connect socket to " +
+                                 m_cfg.rebroadcastAddress);
+    }
+}
+
+void FacialLandmarkDetector::rebroadcast(void)
+{
+    bool keyframe = m_rebroadcastSinceKeyframe == 0;
+
+    unsigned char buf[paramPacketMaxSize];
+    std::size_t size = encodeParamPacket(getParams(), m_rebroadcastSequence,
+                                         keyframe, m_rebroadcastQuantized, buf);
+
+    m_rebroadcastSequence++;
+    if (++m_rebroadcastSinceKeyframe >= m_cfg.rebroadcastKeyframeInterval)
+    {
+        m_rebroadcastSinceKeyframe = 0;
+    }
+
+    // Best effort: a lost packet only delays the receiver until the
+    // next keyframe
+    send(m_rebroadcastSock, (const char *)buf, size, 0);
+}
+
+void FacialLandmarkDetector::closeSocket(int sock)
+{
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+FacialLandmarkDetector::~FacialLandmarkDetector()
+{
+    stop();
+
+    if (m_qualityDumpThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_qualityDumpMutex);
+            m_qualityDumpStop = true;
+        }
+        m_qualityDumpCond.notify_one();
+        m_qualityDumpThread.join();
+    }
+
+    if (m_inputMode == INPUT_SOCKET && !m_cfg.stateFile.empty())
+    {
+        try
+        {
+            saveState();
+        }
+        catch (...)
+        {
+            // Best effort; the next run just starts from scratch
+        }
+    }
+
+    for (const Stream& stream : m_streams)
+    {
+        if (stream.sock >= 0)
+        {
+            closeSocket(stream.sock);
+        }
+    }
+
+    if (m_rebroadcastSock >= 0)
+    {
+        closeSocket(m_rebroadcastSock);
+    }
+}
+
+/* State file layout, in the byte order of the machine:
+ *   "FLCS", uint32 version, int64 time saved (seconds since the epoch),
+ *   uint32 number of records, then per record:
+ *   uint8 name length, name, uint32 number of values, doubles (oldest first)
+ * Records are matched by name on restore, and unknown ones skipped.
+ */
+static const char stateMagic[4] = { 'F', 'L', 'C', 'S' };
+static const std::uint32_t stateVersion = 1;
+
+std::vector<FacialLandmarkDetector::FilterRef> FacialLandmarkDetector::filterRefs(void)
+{
+    return {
+        { "faceXAngle", &m_faceXAngle, &m_faceXAngleMedian },
+        { "faceYAngle", &m_faceYAngle, &m_faceYAngleMedian },
+        { "faceZAngle", &m_faceZAngle, &m_faceZAngleMedian },
+        { "mouthForm", &m_mouthForm, &m_mouthFormMedian },
+        { "mouthOpenness", &m_mouthOpenness, &m_mouthOpennessMedian },
+        { "leftEyeOpenness", &m_leftEyeOpenness, &m_leftEyeOpennessMedian },
+        { "rightEyeOpenness", &m_rightEyeOpenness, &m_rightEyeOpennessMedian },
+        { "leftEyebrowUpDown", &m_leftEyebrowUpDown, &m_leftEyebrowUpDownMedian },
+        { "rightEyebrowUpDown", &m_rightEyebrowUpDown, &m_rightEyebrowUpDownMedian },
+        { "leftEyebrowAngle", &m_leftEyebrowAngle, &m_leftEyebrowAngleMedian },
+        { "rightEyebrowAngle", &m_rightEyebrowAngle, &m_rightEyebrowAngleMedian },
+    };
+}
+
+template <class T>
+static void writeRaw(std::ostream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof value);
+}
+
+template <class T>
+static bool readRaw(const char *data, std::size_t size, std::size_t& pos, T& value)
+{
+    if (size - pos < sizeof value)
+    {
+        return false;
+    }
+    std::memcpy(&value, data + pos, sizeof value);
+    pos += sizeof value;
+    return true;
+}
+
+void FacialLandmarkDetector::saveState(void)
+{
+    // Write to a temporary file first, so that a crash while saving
+    // cannot leave a truncated state behind
+    std::string tmpPath = m_cfg.stateFile + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write " + tmpPath);
+    }
+
+    std::vector<FilterRef> refs = filterRefs();
+    out.write(stateMagic, sizeof stateMagic);
+    writeRaw(out, stateVersion);
+    writeRaw(out, static_cast<std::int64_t>(std::time(nullptr)));
+    writeRaw(out, static_cast<std::uint32_t>(2 * refs.size()));
+
+    std::vector<double> values;
+    for (const FilterRef& ref : refs)
+    {
+        for (int kind = 0; kind < 2; kind++)
+        {
+            // "avg." records hold the moving average, "median." the
+            // median filter before it
+            std::string name = std::string(kind == 0 ? "avg." : "median.") + ref.name;
+            if (kind == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                ref.average->getValues(values);
+            }
+            else
+            {
+                ref.median->getValues(values);
+            }
+
+            writeRaw(out, static_cast<std::uint8_t>(name.size()));
+            out.write(name.data(), name.size());
+            writeRaw(out, static_cast<std::uint32_t>(values.size()));
+            out.write(reinterpret_cast<const char *>(values.data()),
+                      values.size() * sizeof(double));
+        }
+    }
+
+    out.close();
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write " + tmpPath);
+    }
+
+#ifdef _WIN32
+    std::remove(m_cfg.stateFile.c_str());
+#endif
+    if (std::rename(tmpPath.c_str(), m_cfg.stateFile.c_str()) != 0)
+    {
+        throw std::runtime_error("Cannot write " + m_cfg.stateFile);
+    }
+}
+
+void FacialLandmarkDetector::restoreState(void)
+{
+    // A missing or unreadable state file is not an error: the filters
+    // then simply start empty, as without a state file.
+#ifdef _WIN32
+    std::ifstream in(m_cfg.stateFile, std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+    if (parseState(data.data(), data.size(), false))
+    {
+        parseState(data.data(), data.size(), true);
+    }
+#else
+    int fd = open(m_cfg.stateFile.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            // Only restore a complete state, not part of one
+            const char *state = static_cast<const char *>(data);
+            if (parseState(state, st.st_size, false))
+            {
+                parseState(state, st.st_size, true);
+            }
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+#endif
+}
+
+/*! Check the state in data, and with apply = true also restore it */
+bool FacialLandmarkDetector::parseState(const char *data, std::size_t size,
+                                        bool apply)
+{
+    std::size_t pos = 0;
+    char magic[sizeof stateMagic];
+    std::uint32_t version, numRecords;
+    std::int64_t savedTime;
+
+    if (!readRaw(data, size, pos, magic) ||
+        std::memcmp(magic, stateMagic, sizeof magic) != 0 ||
+        !readRaw(data, size, pos, version) || version != stateVersion ||
+        !readRaw(data, size, pos, savedTime) ||
+        !readRaw(data, size, pos, numRecords))
+    {
+        return false;
+    }
+
+    // The face has probably moved on since then
+    if (m_cfg.stateMaxAge > 0 &&
+        std::difftime(std::time(nullptr), static_cast<std::time_t>(savedTime)) > m_cfg.stateMaxAge)
+    {
+        return false;
+    }
+
+    std::vector<FilterRef> refs = filterRefs();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (std::uint32_t r = 0; r < numRecords; r++)
+    {
+        std::uint8_t nameLen;
+        std::uint32_t count;
+        if (!readRaw(data, size, pos, nameLen) || size - pos < nameLen)
+        {
+            return false;
+        }
+        std::string name(data + pos, nameLen);
+        pos += nameLen;
+        if (!readRaw(data, size, pos, count) ||
+            (size - pos) / sizeof(double) < count)
+        {
+            return false;
+        }
+        const char *values = data + pos;
+        pos += count * sizeof(double);
+
+        if (!apply)
+        {
+            continue;
+        }
+
+        // Replaying the values through the filter also copes with a
+        // different number of taps than when the state was saved
+        for (const FilterRef& ref : refs)
+        {
+            bool isAverage = name == std::string("avg.") + ref.name;
+            bool isMedian = name == std::string("median.") + ref.name;
+            if (!isAverage && !isMedian)
+            {
+                continue;
+            }
+
+            for (std::uint32_t i = 0; i < count; i++)
+            {
+                double value;
+                std::memcpy(&value, values + i * sizeof(double), sizeof value);
+                if (isAverage)
+                {
+                    ref.average->push(value);
+                }
+                else
+                {
+                    ref.median->filter(value);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+FacialLandmarkDetector::Params FacialLandmarkDetector::getParams(void) const
+{
+    Params params;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    params.faceXAngle = m_faceXAngle.avg();
+    params.faceYAngle = m_faceYAngle.avg() + m_cfg.faceYAngleCorrection;
+    // + 10 correct for angle between computer monitor and webcam
+    params.faceZAngle = m_faceZAngle.avg();
+    params.mouthOpenness = m_mouthOpenness.avg();
+    params.mouthForm = m_mouthForm.avg();
+    params.leftEyebrowUpDown = m_leftEyebrowUpDown.avg();
+    params.rightEyebrowUpDown = m_rightEyebrowUpDown.avg();
+    params.leftEyebrowAngle = m_leftEyebrowAngle.avg();
+    params.rightEyebrowAngle = m_rightEyebrowAngle.avg();
+
+    double leftEye = m_leftEyeOpenness.avg(1);
+    double rightEye = m_rightEyeOpenness.avg(1);
+
+    lock.unlock();
+    bool sync = !m_cfg.winkEnable;
+
+    if (m_cfg.winkEnable)
+    {
+        if (rightEye < 0.1 && leftEye > 0.2)
+        {
+            leftEye = 1;
+            rightEye = 0;
+        }
+        else if (leftEye < 0.1 && rightEye > 0.2)
+        {
+            leftEye = 0;
+            rightEye = 1;
+        }
+        else
+        {
+            sync = true;
+        }
+    }
+
+    if (sync)
+    {
+        // Combine the two to get better synchronized blinks
+        double bothEyes = (leftEye + rightEye) / 2;
+        leftEye = bothEyes;
+        rightEye = bothEyes;
+    }
+
+    params.leftEyeOpenness = leftEye;
+    params.rightEyeOpenness = rightEye;
+
+    if (leftEye <= m_cfg.eyeSmileEyeOpenThreshold &&
+        rightEye <= m_cfg.eyeSmileEyeOpenThreshold &&
+        params.mouthForm > m_cfg.eyeSmileMouthFormThreshold &&
+        params.mouthOpenness > m_cfg.eyeSmileMouthOpenThreshold)
+    {
+        params.leftEyeSmile = 1;
+        params.rightEyeSmile = 1;
+    }
+    else
+    {
+        params.leftEyeSmile = 0;
+        params.rightEyeSmile = 0;
+    }
+
+    params.autoBlink = m_cfg.autoBlink;
+    params.autoBreath = m_cfg.autoBreath;
+    params.randomMotion = m_cfg.randomMotion;
+
+    return params;
+}
+
+void FacialLandmarkDetector::getParamArray(ParamArray& paramArray) const
+{
+    Params params = getParams();
+
+    double values[NUM_PARAMS];
+    paramsToValues(params, values);
+
+    const std::size_t numBindings = m_cfg.paramBindings.size();
+    for (std::size_t i = 0; i < numBindings; i++)
+    {
+        paramArray.values[i] = static_cast<float>(values[m_cfg.paramBindings[i].param]);
+    }
+    paramArray.size = numBindings;
+
+    paramArray.autoBlink = params.autoBlink;
+    paramArray.autoBreath = params.autoBreath;
+    paramArray.randomMotion = params.randomMotion;
+}
+
+const std::vector<FacialLandmarkDetector::Binding>&
+FacialLandmarkDetector::getBindings(void) const
+{
+    return m_cfg.paramBindings;
+}
+
+void FacialLandmarkDetector::start(void)
+{
+    if (m_inputMode == INPUT_OFFLINE)
+    {
+        throw std::runtime_error("Cannot start an offline detector");
+    }
+    if (m_thread.joinable())
+    {
+        throw std::runtime_error("Detector thread already started");
+    }
+
+    m_stop = false;
+
+    // The thread options are applied from within the new thread, and the
+    // result is reported back so that errors can be thrown from here.
+    std::promise<std::string> setupResult;
+    std::future<std::string> setupError = setupResult.get_future();
+
+    m_thread = std::thread([this, &setupResult]()
+    {
+        try
+        {
+            applyThreadConfig();
+        }
+        catch (const std::exception& e)
+        {
+            setupResult.set_value(e.what());
+            return;
+        }
+        setupResult.set_value("");
+        mainLoop();
+    });
+
+    std::string err = setupError.get();
+    if (err != "")
+    {
+        m_thread.join();
+        throw std::runtime_error(err);
+    }
+}
+
+void FacialLandmarkDetector::stop(void)
+{
+    m_stop = true;
+
+    if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+    {
+        m_thread.join();
+    }
+}
+
+void FacialLandmarkDetector::applyThreadConfig(void)
+{
+#ifdef __linux__
+    pid_t tid = syscall(SYS_gettid);
+
+    if (!m_cfg.threadCpuAffinity.empty())
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : m_cfg.threadCpuAffinity)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+        if (ret != 0)
+        {
+            throw std::runtime_error(std::string("Cannot set CPU affinity: ")
+                                     + std::strerror(ret));
+        }
+    }
+
+    if (m_cfg.threadRealtimePriority > 0)
+    {
+        struct sched_param param;
+        param.sched_priority = m_cfg.threadRealtimePriority;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+        {
+            throw std::runtime_error(std::string("Cannot set SCHED_FIFO priority: ")
+                                     + std::strerror(ret));
+        }
+    }
+    else if (m_cfg.threadNiceness != 0)
+    {
+        // On Linux, niceness is a per-thread attribute
+        if (setpriority(PRIO_PROCESS, tid, m_cfg.threadNiceness) != 0)
+        {
+            throw std::runtime_error(std::string("Cannot set niceness: ")
+                                     + std::strerror(errno));
+        }
+    }
+
+    if (m_cfg.threadName != "")
+    {
+        // Thread names are limited to 15 characters
+        pthread_setname_np(pthread_self(),
+                           m_cfg.threadName.substr(0, 15).c_str());
+    }
+#else
+    if (!m_cfg.threadCpuAffinity.empty() ||
+        m_cfg.threadRealtimePriority > 0 ||
+        m_cfg.threadNiceness != 0)
+    {
+        throw std::runtime_error("Thread scheduling options are only "
+                                 "supported on Linux");
+    }
+#endif
+}
+
+FacialLandmarkDetector::ThreadStats FacialLandmarkDetector::getThreadStats(void) const
+{
+    ThreadStats stats = {};
+    stats.numFrames = m_numFrames;
+    stats.numSkippedFrames = m_numSkippedFrames;
+    stats.numTimestampedFrames = m_numTimestampedFrames;
+    stats.queueDelayNs = m_queueDelayNs;
+    stats.maxQueueDelayNs = m_maxQueueDelayNs;
+    stats.latencyNs = m_latencyNs;
+    stats.numKernelDrops = m_numKernelDrops;
+
+#ifdef __linux__
+    long tid = m_threadId;
+    if (tid != 0)
+    {
+        std::ostringstream path;
+        path << "/proc/self/task/" << tid << "/schedstat";
+        std::ifstream file(path.str());
+        file >> stats.runTimeNs >> stats.runDelayNs >> stats.numTimeslices;
+    }
+#endif
+
+    return stats;
+}
+
+void FacialLandmarkDetector::mainLoop(void)
+{
+    if (m_inputMode == INPUT_OFFLINE)
+    {
+        throw std::runtime_error("Cannot run mainLoop on an offline detector");
+    }
+
+#ifdef __linux__
+    m_threadId = syscall(SYS_gettid);
+#endif
+
+    while (!m_stop)
+    {
+        // Wait for a packet from any of the streams, so that a stream
+        // which lags behind does not hold up the others. Wake up
+        // periodically even if OSF is not sending anything, so that
+        // stop() does not block forever.
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        int maxSock = 0;
+        for (const Stream& stream : m_streams)
+        {
+            FD_SET(stream.sock, &readFds);
+            maxSock = std::max(maxSock, stream.sock);
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = recvTimeoutMs * 1000;
+
+        if (select(maxSock + 1, &readFds, nullptr, nullptr, &timeout) <= 0)
+        {
+            continue;
+        }
+
+        for (std::size_t i = 0; i < m_streams.size(); i++)
+        {
+            if (FD_ISSET(m_streams[i].sock, &readFds))
+            {
+                receivePacket(i);
+            }
+        }
+    }
+}
+
+bool FacialLandmarkDetector::processPacket(const char *buf,
+                                           std::size_t size,
+                                           std::size_t streamIndex)
+{
+    if (size != packetFrameSize || streamIndex >= m_streams.size())
+    {
+        return false;
+    }
+
+    return processPacket(streamIndex, buf);
+}
+
+FacialLandmarkDetector::RecvResult FacialLandmarkDetector::receivePacket(
+    std::size_t streamIndex,
+    int flags)
+{
+    // Read UDP packet from OSF
+    char buf[packetFrameSize];
+    Stream& stream = m_streams[streamIndex];
+
+#ifdef __linux__
+    // recvmsg() also gives us the kernel receive timestamp and drop
+    // counter, if they are enabled (see setSocketOptions())
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof buf;
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct timespec)) +
+                                         CMSG_SPACE(sizeof(std::uint32_t))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    auto recvSize = recvmsg(stream.sock, &msg, flags);
+    if (recvSize < 0) return RECV_NOTHING;
+
+    std::uint64_t arrivalNs = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+        {
+            continue;
+        }
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            std::memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+            arrivalNs = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+        }
+        else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            // Cumulative for the socket, and wraps around
+            std::uint32_t drops;
+            std::memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+            m_numKernelDrops += static_cast<std::uint32_t>(drops - stream.kernelDrops);
+            stream.kernelDrops = drops;
+        }
+    }
+    std::uint64_t recvNs = arrivalNs ? realtimeNs() : 0;
+#else
+    auto recvSize = recv(stream.sock, buf, sizeof buf, flags);
+    if (recvSize < 0) return RECV_NOTHING;
+#endif
+
+    if (recvSize != packetFrameSize) return RECV_IGNORED;
+
+    if (!processPacket(streamIndex, buf))
+    {
+        return RECV_IGNORED;
+    }
+
+#ifdef __linux__
+    if (arrivalNs != 0)
+    {
+        // The clocks may disagree by a little if the system time is
+        // being adjusted
+        std::uint64_t queueDelay = recvNs > arrivalNs ? recvNs - arrivalNs : 0;
+        std::uint64_t doneNs = realtimeNs();
+
+        m_numTimestampedFrames++;
+        m_queueDelayNs += queueDelay;
+        if (queueDelay > m_maxQueueDelayNs)
+        {
+            m_maxQueueDelayNs = queueDelay;
+        }
+        m_latencyNs += doneNs > arrivalNs ? doneNs - arrivalNs : 0;
+    }
+#endif
+
+    if (!m_cfg.qualityDumpPath.empty() &&
+        std::chrono::steady_clock::now() >= m_nextQualityDump &&
+        requestQualityDump())
+    {
+        m_nextQualityDump = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(m_cfg.qualityDumpInterval));
+    }
+
+    return RECV_PROCESSED;
+}
+
+FacialLandmarkDetector::QualityStats FacialLandmarkDetector::getQualityStats(
+    ParamIndex param) const
+{
+    if (param < 0 || param >= NUM_PARAMS)
+    {
+        throw std::out_of_range("Invalid parameter index");
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_quality[param].stats();
+}
+
+bool FacialLandmarkDetector::requestQualityDump(void)
+{
+    // Never wait for the writer thread. If it is busy taking the previous
+    // measures, try again with the next frame.
+    std::unique_lock<std::mutex> lock(m_qualityDumpMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> statsLock(m_mutex);
+        for (int i = 0; i < NUM_PARAMS; i++)
+        {
+            m_qualityDump[i] = m_quality[i].stats();
+        }
+    }
+    m_qualityDumpPending = true;
+
+    lock.unlock();
+    m_qualityDumpCond.notify_one();
+    return true;
+}
+
+void FacialLandmarkDetector::qualityDumpLoop(void)
+{
+#ifdef __linux__
+    // Best effort: the thread inherits the scheduling of whoever created
+    // the detector, which may be a real-time thread
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    const std::string tmpPath = m_cfg.qualityDumpPath + ".tmp";
+    QualityStats stats[NUM_PARAMS];
+
+    std::unique_lock<std::mutex> lock(m_qualityDumpMutex);
+    while (true)
+    {
+        m_qualityDumpCond.wait(lock, [this]()
+        {
+            return m_qualityDumpPending || m_qualityDumpStop;
+        });
+        if (!m_qualityDumpPending)
+        {
+            return;
+        }
+
+        std::copy(m_qualityDump, m_qualityDump + NUM_PARAMS, stats);
+        m_qualityDumpPending = false;
+
+        lock.unlock();
+        writeQualityDump(stats, tmpPath);
+        lock.lock();
+    }
+}
+
+void FacialLandmarkDetector::writeQualityDump(const QualityStats stats[],
+                                              const std::string& tmpPath) const
+{
+    // Formatted into a fixed buffer and written with plain system calls,
+    // so that this does not allocate either (see tests/alloc_test.cpp)
+    char buf[4096];
+    std::size_t size = std::snprintf(
+        buf, sizeof buf,
+        "# param numFrames jitter rawJitter lag saturatedLow saturatedHigh\n");
+    for (int i = 0; i < NUM_PARAMS && size < sizeof buf; i++)
+    {
+        if (stats[i].numFrames == 0)
+        {
+            continue;
+        }
+        size += std::snprintf(buf + size, sizeof buf - size,
+                              "%s %" PRIu64 " %g %g %g %g %g\n", paramNames[i],
+                              stats[i].numFrames, stats[i].jitter,
+                              stats[i].rawJitter, stats[i].lag,
+                              stats[i].saturatedLow, stats[i].saturatedHigh);
+    }
+    size = std::min(size, sizeof buf - 1);
+
+    // Written to a temporary file and renamed, so that a reader never
+    // sees a partial dump. Best effort, as there is no one to report to.
+#ifdef _WIN32
+    std::FILE *file = std::fopen(tmpPath.c_str(), "wb");
+    if (!file)
+    {
+        return;
+    }
+    bool ok = std::fwrite(buf, 1, size, file) == size;
+    ok = std::fclose(file) == 0 && ok;
+    if (ok)
+    {
+        std::remove(m_cfg.qualityDumpPath.c_str());
+    }
+#else
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    bool ok = write(fd, buf, size) == static_cast<ssize_t>(size);
+    ok = close(fd) == 0 && ok;
+#endif
+    if (ok)
+    {
+        std::rename(tmpPath.c_str(), m_cfg.qualityDumpPath.c_str());
+    }
+}
+
+bool FacialLandmarkDetector::processPacket(std::size_t streamIndex,
+                                           const char *buf)
+{
+    // Note: This is dependent on endianness, and we would assume that
+    // the OSF instance is run on a machine with the same endianness
+    // as our current machine.
+    int recvFaceId = *(int *)(buf + 8);
+    if (recvFaceId != m_faceId) return false; // We only support one face
+
+    Point landmarks[nPoints];
+    double sumConfidence = 0;
+
+    for (int i = 0; i < nPoints; i++)
+    {
+        float x = *(float *)(buf + landmarksOffset + i * 2 * sizeof(float));
+        float y = *(float *)(buf + landmarksOffset + (i * 2 + 1) * sizeof(float));
+
+        landmarks[i].x = x;
+        landmarks[i].y = y;
+
+        sumConfidence += *(float *)(buf + confidenceOffset + i * sizeof(float));
+    }
+
+    Stream& stream = m_streams[streamIndex];
+    stream.timestamp = *(double *)(buf + timestampOffset);
+    stream.confidence = sumConfidence / nPoints;
+
+    // Cheap enough to take from every frame, even a static one
+    readOsfFeatures(buf, stream.features);
+
+    // If the face has barely moved since the last frame whose features
+    // were calculated, keep using those features and just advance the
+    // filters. Comparing against that frame rather than the previous one
+    // means slow drifts still add up until they cross the threshold.
+    if (stream.valid && isStatic(stream, landmarks))
+    {
+        m_numSkippedFrames++;
+    }
+    else
+    {
+        calcFeatures(landmarks, stream.features, stream.eyeDistance);
+        std::copy(landmarks, landmarks + nPoints, stream.landmarks);
+        stream.valid = true;
+    }
+
+    m_numFrames++;
+
+    // With several streams, only the frames of one of them advance the
+    // filters, so that the filter taps span the same time however many
+    // cameras there are. The frames of the others are combined into its
+    // next one.
+    if (!isFusionLeader(streamIndex))
+    {
+        return true;
+    }
+
+    /* The coordinates seem to be rather noisy in general.
+     * We will push everything through some moving average filters
+     * to reduce noise. The number of taps is determined empirically
+     * until we get something good.
+     * An alternative method would be to get some better dataset -
+     * perhaps even to train on a custom data set just for the user.
+     */
+
+    Features fused;
+    fuseStreams(streamIndex, fused);
+    const Features raw = fused;
+
+    // Reject glitches before they are smeared over several frames
+    // by the moving averages
+    fused.faceXAngle = m_faceXAngleMedian.filter(fused.faceXAngle);
+    fused.mouthForm = m_mouthFormMedian.filter(fused.mouthForm);
+    fused.faceYAngle = m_faceYAngleMedian.filter(fused.faceYAngle);
+    fused.faceZAngle = m_faceZAngleMedian.filter(fused.faceZAngle);
+    fused.mouthOpenness = m_mouthOpennessMedian.filter(fused.mouthOpenness);
+    fused.leftEyeOpenness = m_leftEyeOpennessMedian.filter(fused.leftEyeOpenness);
+    fused.rightEyeOpenness = m_rightEyeOpennessMedian.filter(fused.rightEyeOpenness);
+    fused.leftEyebrowUpDown = m_leftEyebrowUpDownMedian.filter(fused.leftEyebrowUpDown);
+    fused.rightEyebrowUpDown = m_rightEyebrowUpDownMedian.filter(fused.rightEyebrowUpDown);
+    fused.leftEyebrowAngle = m_leftEyebrowAngleMedian.filter(fused.leftEyebrowAngle);
+    fused.rightEyebrowAngle = m_rightEyebrowAngleMedian.filter(fused.rightEyebrowAngle);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_faceXAngle.push(fused.faceXAngle);
+        m_mouthForm.push(fused.mouthForm);
+        m_faceYAngle.push(fused.faceYAngle);
+        m_faceZAngle.push(fused.faceZAngle);
+        m_mouthOpenness.push(fused.mouthOpenness);
+        m_leftEyeOpenness.push(fused.leftEyeOpenness);
+        m_rightEyeOpenness.push(fused.rightEyeOpenness);
+        m_leftEyebrowUpDown.push(fused.leftEyebrowUpDown);
+        m_rightEyebrowUpDown.push(fused.rightEyebrowUpDown);
+        m_leftEyebrowAngle.push(fused.leftEyebrowAngle);
+        m_rightEyebrowAngle.push(fused.rightEyebrowAngle);
+
+        m_quality[PARAM_FACE_X_ANGLE].update(raw.faceXAngle, m_faceXAngle.avg());
+        m_quality[PARAM_FACE_Y_ANGLE].update(raw.faceYAngle, m_faceYAngle.avg());
+        m_quality[PARAM_FACE_Z_ANGLE].update(raw.faceZAngle, m_faceZAngle.avg());
+        m_quality[PARAM_MOUTH_FORM].update(raw.mouthForm, m_mouthForm.avg());
+        m_quality[PARAM_MOUTH_OPENNESS].update(raw.mouthOpenness, m_mouthOpenness.avg());
+        m_quality[PARAM_LEFT_EYE_OPENNESS].update(raw.leftEyeOpenness,
+                                                  m_leftEyeOpenness.avg());
+        m_quality[PARAM_RIGHT_EYE_OPENNESS].update(raw.rightEyeOpenness,
+                                                   m_rightEyeOpenness.avg());
+        m_quality[PARAM_LEFT_EYEBROW_UP_DOWN].update(raw.leftEyebrowUpDown,
+                                                     m_leftEyebrowUpDown.avg());
+        m_quality[PARAM_RIGHT_EYEBROW_UP_DOWN].update(raw.rightEyebrowUpDown,
+                                                      m_rightEyebrowUpDown.avg());
+        m_quality[PARAM_LEFT_EYEBROW_ANGLE].update(raw.leftEyebrowAngle,
+                                                   m_leftEyebrowAngle.avg());
+        m_quality[PARAM_RIGHT_EYEBROW_ANGLE].update(raw.rightEyebrowAngle,
+                                                    m_rightEyebrowAngle.avg());
+    }
+
+    if (m_rebroadcastSock >= 0)
+    {
+        rebroadcast();
+    }
+
+    return true;
+}
+
+bool FacialLandmarkDetector::isStatic(const Stream& stream,
+                                      const Point landmarks[]) const
+{
+    if (m_cfg.motionSkipThreshold <= 0 || stream.eyeDistance <= 0)
+    {
+        return false;
+    }
+
+    // Largest landmark movement, relative to the size of the face
+    double maxDistSq = sq(m_cfg.motionSkipThreshold * stream.eyeDistance);
+    for (int i = 0; i < nPoints; i++)
+    {
+        double distSq = sq(landmarks[i].x - stream.landmarks[i].x) +
+                        sq(landmarks[i].y - stream.landmarks[i].y);
+        if (distSq > maxDistSq)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FacialLandmarkDetector::calcFeatures(const Point landmarks[],
+                                          Features& features,
+                                          double& eyeDistance) const
+{
+    FeatureContext ctx;
+    initFeatureContext(ctx, landmarks);
+    eyeDistance = ctx.eyeDistance;
+
+    // Face rotation: X direction (left-right)
+    features.faceXAngle = calcFaceXAngle(ctx);
+
+    // With FEATURES_OSF, the eye and mouth features have already been
+    // taken from the packet by readOsfFeatures()
+    const bool fromLandmarks = m_cfg.featureSource == FEATURES_LANDMARKS;
+
+    // Mouth form (smile / laugh) detection
+    if (fromLandmarks)
+    {
+        features.mouthForm = calcMouthForm(ctx);
+    }
+
+    // Face rotation: Y direction (up-down)
+    // Depends on: X rotation, mouth form
+    features.faceYAngle = calcFaceYAngle(ctx, features.faceXAngle,
+                                         features.mouthForm);
+    ctx.faceYAngleCos = std::cos(degToRad(features.faceYAngle));
+
+    // Face rotation: Z direction (head tilt)
+    features.faceZAngle = calcFaceZAngle(ctx);
+
+    if (fromLandmarks)
+    {
+        // Mouth openness
+        // Depends on: mouth form
+        features.mouthOpenness = calcMouthOpenness(ctx, features.mouthForm);
+
+        // Eye openness
+        // Depends on: Y rotation
+        features.leftEyeOpenness = calcEyeOpenness(LEFT, ctx);
+        features.rightEyeOpenness = calcEyeOpenness(RIGHT, ctx);
+    }
+}
+
+void FacialLandmarkDetector::readOsfFeatures(const char *buf,
+                                             Features& features) const
+{
+    /* OSF normalizes each of these against the range it has seen so far:
+     * about 0 for the usual value, -1 and 1 for the extremes. So the eyes
+     * are near 0 when open, and the mouth is near 0 when closed.
+     */
+    features.leftEyebrowUpDown = osfFeature(buf, OSF_EYEBROW_UPDOWN_L);
+    features.rightEyebrowUpDown = osfFeature(buf, OSF_EYEBROW_UPDOWN_R);
+    features.leftEyebrowAngle = osfFeature(buf, OSF_EYEBROW_STEEPNESS_L);
+    features.rightEyebrowAngle = osfFeature(buf, OSF_EYEBROW_STEEPNESS_R);
+
+    if (m_cfg.featureSource != FEATURES_OSF)
+    {
+        return;
+    }
+
+    features.leftEyeOpenness = linearScale01(osfFeature(buf, OSF_EYE_L),
+                                             m_cfg.osfEyeClosedThreshold,
+                                             m_cfg.osfEyeOpenThreshold);
+    features.rightEyeOpenness = linearScale01(osfFeature(buf, OSF_EYE_R),
+                                              m_cfg.osfEyeClosedThreshold,
+                                              m_cfg.osfEyeOpenThreshold);
+    features.mouthForm = linearScale01(osfFeature(buf, OSF_MOUTH_WIDE),
+                                       m_cfg.osfMouthNormalThreshold,
+                                       m_cfg.osfMouthSmileThreshold);
+    features.mouthOpenness = linearScale01(osfFeature(buf, OSF_MOUTH_OPEN),
+                                           m_cfg.osfMouthClosedThreshold,
+                                           m_cfg.osfMouthOpenThreshold);
+}
+
+bool FacialLandmarkDetector::isFusionLeader(std::size_t streamIndex) const
+{
+    // The leader is the primary stream, or if that falls behind (or
+    // stops), the next stream that keeps up with the one just received
+    const Stream& latest = m_streams[streamIndex];
+    for (std::size_t i = 0; i < streamIndex; i++)
+    {
+        const Stream& stream = m_streams[i];
+        if (stream.valid &&
+            std::abs(stream.timestamp - latest.timestamp) <= m_cfg.osfFusionMaxSkew)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FacialLandmarkDetector::fuseStreams(std::size_t latestIndex,
+                                         Features& fused) const
+{
+    const Stream& latest = m_streams[latestIndex];
+
+    if (m_streams.size() == 1)
+    {
+        fused = latest.features;
+        return;
+    }
+
+    /* Combine the latest frame of every stream that is close enough in
+     * time to the frame just received. Streams which lag behind are left
+     * out rather than waited for.
+     *
+     * Each stream is weighted by the mean landmark confidence reported
+     * by OSF, and by how directly its camera sees the face: the weight
+     * falls off as the X angle seen by that camera approaches the +-30
+     * degree limit of calcFaceXAngle(), where the estimate saturates.
+     */
+    double sumWeights = 0;
+    Features sum = {};
+
+    for (const Stream& stream : m_streams)
+    {
+        if (!stream.valid ||
+            std::abs(stream.timestamp - latest.timestamp) > m_cfg.osfFusionMaxSkew)
+        {
+            continue;
+        }
+
+        double viewWeight = std::max(1 - std::abs(stream.features.faceXAngle) / 30,
+                                     minViewWeight);
+        double w = stream.confidence * viewWeight;
+
+        // The X angle is made relative to the primary camera
+        sum.faceXAngle += w * (stream.features.faceXAngle + stream.yawOffset);
+        sum.faceYAngle += w * stream.features.faceYAngle;
+        sum.faceZAngle += w * stream.features.faceZAngle;
+        sum.mouthForm += w * stream.features.mouthForm;
+        sum.mouthOpenness += w * stream.features.mouthOpenness;
+        sum.leftEyeOpenness += w * stream.features.leftEyeOpenness;
+        sum.rightEyeOpenness += w * stream.features.rightEyeOpenness;
+        sum.leftEyebrowUpDown += w * stream.features.leftEyebrowUpDown;
+        sum.rightEyebrowUpDown += w * stream.features.rightEyebrowUpDown;
+        sum.leftEyebrowAngle += w * stream.features.leftEyebrowAngle;
+        sum.rightEyebrowAngle += w * stream.features.rightEyebrowAngle;
+        sumWeights += w;
+    }
+
+    if (sumWeights <= 0)
+    {
+        fused = latest.features;
+        fused.faceXAngle += latest.yawOffset;
+    }
+    else
+    {
+        fused.faceXAngle = sum.faceXAngle / sumWeights;
+        fused.faceYAngle = sum.faceYAngle / sumWeights;
+        fused.faceZAngle = sum.faceZAngle / sumWeights;
+        fused.mouthForm = sum.mouthForm / sumWeights;
+        fused.mouthOpenness = sum.mouthOpenness / sumWeights;
+        fused.leftEyeOpenness = sum.leftEyeOpenness / sumWeights;
+        fused.rightEyeOpenness = sum.rightEyeOpenness / sumWeights;
+        fused.leftEyebrowUpDown = sum.leftEyebrowUpDown / sumWeights;
+        fused.rightEyebrowUpDown = sum.rightEyebrowUpDown / sumWeights;
+        fused.leftEyebrowAngle = sum.leftEyebrowAngle / sumWeights;
+        fused.rightEyebrowAngle = sum.rightEyebrowAngle / sumWeights;
+    }
+
+    if (fused.faceXAngle < -30) fused.faceXAngle = -30;
+    if (fused.faceXAngle > 30) fused.faceXAngle = 30;
+}
+
+double FacialLandmarkDetector::calcEyeAspectRatio(
+    const Point& p1, const Point& p2,
+    const Point& p3, const Point& p4,
+    const Point& p5, const Point& p6) const
+{
+    double eyeWidth = dist(p1, p4);
+    double eyeHeight1 = dist(p2, p6);
+    double eyeHeight2 = dist(p3, p5);
+
+    return (eyeHeight1 + eyeHeight2) / (2 * eyeWidth);
+}
+
+void FacialLandmarkDetector::initFeatureContext(
+    FeatureContext& ctx,
+    const Point landmarks[]) const
+{
+    ctx.landmarks = landmarks;
+
+    ctx.rightEye = centroid(landmarks[36], landmarks[37], landmarks[38],
+                            landmarks[39], landmarks[40], landmarks[41]);
+    ctx.leftEye = centroid(landmarks[42], landmarks[43], landmarks[44],
+                           landmarks[45], landmarks[46], landmarks[47]);
+    ctx.eyeDistance = dist(ctx.rightEye, ctx.leftEye);
+
+    ctx.mouthWidth = dist(landmarks[58], landmarks[62]);
+
+    // Not known until the Y angle has been calculated
+    ctx.faceYAngleCos = 1;
+}
+
+double FacialLandmarkDetector::calcEyeOpenness(
+    LeftRight eye,
+    const FeatureContext& ctx) const
+{
+    const Point *landmarks = ctx.landmarks;
+    double eyeAspectRatio;
+    if (eye == LEFT)
+    {
+        eyeAspectRatio = calcEyeAspectRatio(landmarks[42], landmarks[43], landmarks[44],
+                                            landmarks[45], landmarks[46], landmarks[47]);
+    }
+    else
+    {
+        eyeAspectRatio = calcEyeAspectRatio(landmarks[36], landmarks[37], landmarks[38],
+                                            landmarks[39], landmarks[40], landmarks[41]);
+    }
+
+    // Apply correction due to faceYAngle
+    double corrEyeAspRat = eyeAspectRatio / ctx.faceYAngleCos;
+
+    return linearScale01(corrEyeAspRat, m_cfg.eyeClosedThreshold, m_cfg.eyeOpenThreshold);
+}
+
+
+
+double FacialLandmarkDetector::calcMouthForm(const FeatureContext& ctx) const
+{
+    /* Mouth form parameter: 0 for normal mouth, 1 for fully smiling / laughing.
+     * Compare distance between the two corners of the mouth
+     * to the distance between the two eyes.
+     */
+
+    /* An alternative (my initial attempt) was to compare the corners of
+     * the mouth to the top of the upper lip - they almost lie on a
+     * straight line when smiling / laughing. But that is only true
+     * when facing straight at the camera. When looking up / down,
+     * the angle changes. So here we'll use the distance approach instead.
+     */
+
+    double form = linearScale01(ctx.mouthWidth / ctx.eyeDistance,
+                                m_cfg.mouthNormalThreshold,
+                                m_cfg.mouthSmileThreshold);
+
+    return form;
+}
+
+double FacialLandmarkDetector::calcMouthOpenness(
+    const FeatureContext& ctx,
+    double mouthForm) const
+{
+    const Point *landmarks = ctx.landmarks;
+
+    // Use points for the bottom of the upper lip, and top of the lower lip
+    // We have 3 pairs of points available, which give the mouth height
+    // on the left, in the middle, and on the right, resp.
+    // First let's try to use an average of all three.
+    double heightLeft   = dist(landmarks[61], landmarks[63]);
+    double heightMiddle = dist(landmarks[60], landmarks[64]);
+    double heightRight  = dist(landmarks[59], landmarks[65]);
+
+    double avgHeight = (heightLeft + heightMiddle + heightRight) / 3;
+
+    // Now, normalize it with the width of the mouth.
+    double normalized = avgHeight / ctx.mouthWidth;
+
+    double scaled = linearScale01(normalized,
+                                  m_cfg.mouthClosedThreshold,
+                                  m_cfg.mouthOpenThreshold,
+                                  true, false);
+
+    // Apply correction according to mouthForm
+    // Notice that when you smile / laugh, width is increased
+    scaled *= (1 + m_cfg.mouthOpenLaughCorrection * mouthForm);
+
+    return scaled;
+}
+
+double FacialLandmarkDetector::calcFaceXAngle(const FeatureContext& ctx) const
+{
+    const Point *landmarks = ctx.landmarks;
+
+    // This function will be easier to understand if you refer to the
+    // diagram in faceXAngle.png
+
+    // Construct the y-axis using (1) average of four points on the nose and
+    // (2) average of five points on the upper lip.
+
+    auto y0 = centroid(landmarks[27], landmarks[28], landmarks[29],
+                       landmarks[30]);
+    auto y1 = centroid(landmarks[48], landmarks[49], landmarks[50],
+                       landmarks[51], landmarks[52]);
+
+    // Now drop a perpedicular from the left and right edges of the face,
+    // and calculate the ratio between the lengths of these perpendiculars
 
     auto left = centroid(landmarks[14], landmarks[15], landmarks[16]);
     auto right = centroid(landmarks[0], landmarks[1], landmarks[2]);
@@ -375,8 +2137,10 @@ double FacialLandmarkDetector::calcFaceXAngle(Point landmarks[]) const
     return theta;
 }
 
-double FacialLandmarkDetector::calcFaceYAngle(Point landmarks[], double faceXAngle, double mouthForm) const
+double FacialLandmarkDetector::calcFaceYAngle(const FeatureContext& ctx, double faceXAngle, double mouthForm) const
 {
+    const Point *landmarks = ctx.landmarks;
+
     // Use the nose
     // angle between the two left/right points and the tip
     double c = dist(landmarks[31], landmarks[35]);
@@ -413,17 +2177,15 @@ double FacialLandmarkDetector::calcFaceYAngle(Point landmarks[], double faceXAng
     }
 }
 
-double FacialLandmarkDetector::calcFaceZAngle(Point landmarks[]) const
+double FacialLandmarkDetector::calcFaceZAngle(const FeatureContext& ctx) const
 {
     // Use average of eyes and nose
 
-    auto eyeRight = centroid(landmarks[36], landmarks[37], landmarks[38],
-                             landmarks[39], landmarks[40], landmarks[41]);
-    auto eyeLeft  = centroid(landmarks[42], landmarks[43], landmarks[44],
-                             landmarks[45], landmarks[46], landmarks[47]);
+    const Point& eyeRight = ctx.rightEye;
+    const Point& eyeLeft  = ctx.leftEye;
 
-    auto noseLeft  = landmarks[35];
-    auto noseRight = landmarks[31];
+    const Point& noseLeft  = ctx.landmarks[35];
+    const Point& noseRight = ctx.landmarks[31];
 
     double eyeYDiff = eyeRight.y - eyeLeft.y;
     double eyeXDiff = eyeRight.x - eyeLeft.x;
@@ -438,273 +2200,690 @@ double FacialLandmarkDetector::calcFaceZAngle(Point landmarks[]) const
     return radToDeg((angle1 + angle2) / 2);
 }
 
-void FacialLandmarkDetector::parseConfig(std::string cfgPath)
+void FacialLandmarkDetector::parseConfig(std::string cfgPath,
+                                         std::string cfgOverrides)
 {
     populateDefaultConfig();
+
+    bool hasParamBindings = false;
+
     if (cfgPath != "")
     {
         std::ifstream file(cfgPath);
 
-        if (!file)
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open config file");
+        }
+
+        parseConfigLines(file, hasParamBindings);
+    }
+
+    std::istringstream overrides(cfgOverrides);
+    parseConfigLines(overrides, hasParamBindings);
+}
+
+void FacialLandmarkDetector::parseConfigLines(std::istream& file,
+                                              bool& hasParamBindings)
+{
+    std::string line;
+    unsigned int lineNum = 0;
+
+    while (std::getline(file, line))
+    {
+        lineNum++;
+
+        if (line[0] == '#')
         {
-            throw std::runtime_error("Failed to open config file");
+            continue;
         }
 
-        std::string line;
-        unsigned int lineNum = 0;
-
-        while (std::getline(file, line))
+        std::istringstream ss(line);
+        std::string paramName;
+        if (ss >> paramName)
         {
-            lineNum++;
-
-            if (line[0] == '#')
+            if (paramName == "osfIpAddress")
             {
-                continue;
+                if (!(ss >> m_cfg.osfIpAddress))
+                {
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
+                }
             }
-
-            std::istringstream ss(line);
-            std::string paramName;
-            if (ss >> paramName)
+            else if (paramName == "osfPort")
             {
-                if (paramName == "osfIpAddress")
+                if (!(ss >> m_cfg.osfPort))
                 {
-                    if (!(ss >> m_cfg.osfIpAddress))
-                    {
-                        throwConfigError(paramName, "std::string",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
                 }
-                else if (paramName == "osfPort")
+            }
+            else if (paramName == "osfExtraStream")
+            {
+                Config::ExtraStream extra;
+                if (!(ss >> extra.port >> extra.yawOffset))
                 {
-                    if (!(ss >> m_cfg.osfPort))
-                    {
-                        throwConfigError(paramName, "int",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleCorrection")
+                m_cfg.osfExtraStreams.push_back(extra);
+            }
+            else if (paramName == "osfMulticastInterface")
+            {
+                if (!(ss >> m_cfg.osfMulticastInterface))
                 {
-                    if (!(ss >> m_cfg.faceYAngleCorrection))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
                 }
-                else if (paramName == "eyeSmileEyeOpenThreshold")
+            }
+            else if (paramName == "osfReusePort")
+            {
+                if (!(ss >> m_cfg.osfReusePort))
                 {
-                    if (!(ss >> m_cfg.eyeSmileEyeOpenThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
                 }
-                else if (paramName == "eyeSmileMouthFormThreshold")
+            }
+            else if (paramName == "osfRecvBufferSize")
+            {
+                if (!(ss >> m_cfg.osfRecvBufferSize))
                 {
-                    if (!(ss >> m_cfg.eyeSmileMouthFormThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
                 }
-                else if (paramName == "eyeSmileMouthOpenThreshold")
+            }
+            else if (paramName == "osfBusyPoll")
+            {
+                if (!(ss >> m_cfg.osfBusyPoll))
                 {
-                    if (!(ss >> m_cfg.eyeSmileMouthOpenThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceXAngleNumTaps")
+            }
+            else if (paramName == "osfKernelTimestamps")
+            {
+                if (!(ss >> m_cfg.osfKernelTimestamps))
                 {
-                    if (!(ss >> m_cfg.faceXAngleNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleNumTaps")
+            }
+            else if (paramName == "osfFusionMaxSkew")
+            {
+                if (!(ss >> m_cfg.osfFusionMaxSkew))
                 {
-                    if (!(ss >> m_cfg.faceYAngleNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceZAngleNumTaps")
+            }
+            else if (paramName == "motionSkipThreshold")
+            {
+                if (!(ss >> m_cfg.motionSkipThreshold))
                 {
-                    if (!(ss >> m_cfg.faceZAngleNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthFormNumTaps")
+            }
+            else if (paramName == "featureSource")
+            {
+                std::string source;
+                ss >> source;
+                if (source == "landmarks")
                 {
-                    if (!(ss >> m_cfg.mouthFormNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    m_cfg.featureSource = FEATURES_LANDMARKS;
                 }
-                else if (paramName == "mouthOpenNumTaps")
+                else if (source == "osf")
                 {
-                    if (!(ss >> m_cfg.mouthOpenNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    m_cfg.featureSource = FEATURES_OSF;
                 }
-                else if (paramName == "leftEyeOpenNumTaps")
+                else
                 {
-                    if (!(ss >> m_cfg.leftEyeOpenNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "\"landmarks\" or \"osf\"",
+                                     line, lineNum);
                 }
-                else if (paramName == "rightEyeOpenNumTaps")
+            }
+            else if (paramName == "rebroadcastAddress")
+            {
+                if (!(ss >> m_cfg.rebroadcastAddress))
                 {
-                    if (!(ss >> m_cfg.rightEyeOpenNumTaps))
-                    {
-                        throwConfigError(paramName, "std::size_t",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
                 }
-                else if (paramName == "eyeClosedThreshold")
+            }
+            else if (paramName == "rebroadcastPort")
+            {
+                if (!(ss >> m_cfg.rebroadcastPort))
                 {
-                    if (!(ss >> m_cfg.eyeClosedThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
                 }
-                else if (paramName == "eyeOpenThreshold")
+            }
+            else if (paramName == "rebroadcastKeyframeInterval")
+            {
+                if (!(ss >> m_cfg.rebroadcastKeyframeInterval) ||
+                    m_cfg.rebroadcastKeyframeInterval < 1)
                 {
-                    if (!(ss >> m_cfg.eyeOpenThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "int (>= 1)",
+                                     line, lineNum);
                 }
-                else if (paramName == "winkEnable")
+            }
+            else if (paramName == "stateFile")
+            {
+                if (!(ss >> m_cfg.stateFile))
                 {
-                    if (!(ss >> m_cfg.winkEnable))
-                    {
-                        throwConfigError(paramName, "bool",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthNormalThreshold")
+            }
+            else if (paramName == "stateMaxAge")
+            {
+                if (!(ss >> m_cfg.stateMaxAge))
                 {
-                    if (!(ss >> m_cfg.mouthNormalThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthSmileThreshold")
+            }
+            else if (paramName == "qualityWindow")
+            {
+                if (!(ss >> m_cfg.qualityWindow))
                 {
-                    if (!(ss >> m_cfg.mouthSmileThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthClosedThreshold")
+            }
+            else if (paramName == "qualityDumpPath")
+            {
+                if (!(ss >> m_cfg.qualityDumpPath))
                 {
-                    if (!(ss >> m_cfg.mouthClosedThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthOpenThreshold")
+            }
+            else if (paramName == "qualityDumpInterval")
+            {
+                if (!(ss >> m_cfg.qualityDumpInterval))
                 {
-                    if (!(ss >> m_cfg.mouthOpenThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "mouthOpenLaughCorrection")
+            }
+            else if (paramName == "faceYAngleCorrection")
+            {
+                if (!(ss >> m_cfg.faceYAngleCorrection))
                 {
-                    if (!(ss >> m_cfg.mouthOpenLaughCorrection))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleXRotCorrection")
+            }
+            else if (paramName == "eyeSmileEyeOpenThreshold")
+            {
+                if (!(ss >> m_cfg.eyeSmileEyeOpenThreshold))
                 {
-                    if (!(ss >> m_cfg.faceYAngleXRotCorrection))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleSmileCorrection")
+            }
+            else if (paramName == "eyeSmileMouthFormThreshold")
+            {
+                if (!(ss >> m_cfg.eyeSmileMouthFormThreshold))
                 {
-                    if (!(ss >> m_cfg.faceYAngleSmileCorrection))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleZeroValue")
+            }
+            else if (paramName == "eyeSmileMouthOpenThreshold")
+            {
+                if (!(ss >> m_cfg.eyeSmileMouthOpenThreshold))
                 {
-                    if (!(ss >> m_cfg.faceYAngleZeroValue))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleUpThreshold")
+            }
+            else if (paramName == "faceXAngleNumTaps")
+            {
+                if (!(ss >> m_cfg.faceXAngleNumTaps))
                 {
-                    if (!(ss >> m_cfg.faceYAngleUpThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
                 }
-                else if (paramName == "faceYAngleDownThreshold")
+            }
+            else if (paramName == "faceYAngleNumTaps")
+            {
+                if (!(ss >> m_cfg.faceYAngleNumTaps))
                 {
-                    if (!(ss >> m_cfg.faceYAngleDownThreshold))
-                    {
-                        throwConfigError(paramName, "double",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
                 }
-                else if (paramName == "autoBlink")
+            }
+            else if (paramName == "faceZAngleNumTaps")
+            {
+                if (!(ss >> m_cfg.faceZAngleNumTaps))
                 {
-                    if (!(ss >> m_cfg.autoBlink))
-                    {
-                        throwConfigError(paramName, "bool",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
                 }
-                else if (paramName == "autoBreath")
+            }
+            else if (paramName == "mouthFormNumTaps")
+            {
+                if (!(ss >> m_cfg.mouthFormNumTaps))
                 {
-                    if (!(ss >> m_cfg.autoBreath))
-                    {
-                        throwConfigError(paramName, "bool",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
                 }
-                else if (paramName == "randomMotion")
+            }
+            else if (paramName == "mouthOpenNumTaps")
+            {
+                if (!(ss >> m_cfg.mouthOpenNumTaps))
                 {
-                    if (!(ss >> m_cfg.randomMotion))
-                    {
-                        throwConfigError(paramName, "bool",
-                                         line, lineNum);
-                    }
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
                 }
-                else
+            }
+            else if (paramName == "leftEyeOpenNumTaps")
+            {
+                if (!(ss >> m_cfg.leftEyeOpenNumTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "rightEyeOpenNumTaps")
+            {
+                if (!(ss >> m_cfg.rightEyeOpenNumTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "eyebrowNumTaps")
+            {
+                if (!(ss >> m_cfg.eyebrowNumTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceXAngleMedianTaps")
+            {
+                if (!(ss >> m_cfg.faceXAngleMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleMedianTaps")
+            {
+                if (!(ss >> m_cfg.faceYAngleMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceZAngleMedianTaps")
+            {
+                if (!(ss >> m_cfg.faceZAngleMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthFormMedianTaps")
+            {
+                if (!(ss >> m_cfg.mouthFormMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthOpenMedianTaps")
+            {
+                if (!(ss >> m_cfg.mouthOpenMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "leftEyeOpenMedianTaps")
+            {
+                if (!(ss >> m_cfg.leftEyeOpenMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "rightEyeOpenMedianTaps")
+            {
+                if (!(ss >> m_cfg.rightEyeOpenMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "eyebrowMedianTaps")
+            {
+                if (!(ss >> m_cfg.eyebrowMedianTaps))
+                {
+                    throwConfigError(paramName, "std::size_t",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceXAngleHampelThreshold")
+            {
+                if (!(ss >> m_cfg.faceXAngleHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleHampelThreshold")
+            {
+                if (!(ss >> m_cfg.faceYAngleHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceZAngleHampelThreshold")
+            {
+                if (!(ss >> m_cfg.faceZAngleHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthFormHampelThreshold")
+            {
+                if (!(ss >> m_cfg.mouthFormHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthOpenHampelThreshold")
+            {
+                if (!(ss >> m_cfg.mouthOpenHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "leftEyeOpenHampelThreshold")
+            {
+                if (!(ss >> m_cfg.leftEyeOpenHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "rightEyeOpenHampelThreshold")
+            {
+                if (!(ss >> m_cfg.rightEyeOpenHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "eyebrowHampelThreshold")
+            {
+                if (!(ss >> m_cfg.eyebrowHampelThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "eyeClosedThreshold")
+            {
+                if (!(ss >> m_cfg.eyeClosedThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "eyeOpenThreshold")
+            {
+                if (!(ss >> m_cfg.eyeOpenThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "winkEnable")
+            {
+                if (!(ss >> m_cfg.winkEnable))
+                {
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthNormalThreshold")
+            {
+                if (!(ss >> m_cfg.mouthNormalThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthSmileThreshold")
+            {
+                if (!(ss >> m_cfg.mouthSmileThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthClosedThreshold")
+            {
+                if (!(ss >> m_cfg.mouthClosedThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthOpenThreshold")
+            {
+                if (!(ss >> m_cfg.mouthOpenThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "mouthOpenLaughCorrection")
+            {
+                if (!(ss >> m_cfg.mouthOpenLaughCorrection))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfEyeClosedThreshold")
+            {
+                if (!(ss >> m_cfg.osfEyeClosedThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfEyeOpenThreshold")
+            {
+                if (!(ss >> m_cfg.osfEyeOpenThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfMouthNormalThreshold")
+            {
+                if (!(ss >> m_cfg.osfMouthNormalThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfMouthSmileThreshold")
+            {
+                if (!(ss >> m_cfg.osfMouthSmileThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfMouthClosedThreshold")
+            {
+                if (!(ss >> m_cfg.osfMouthClosedThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "osfMouthOpenThreshold")
+            {
+                if (!(ss >> m_cfg.osfMouthOpenThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleXRotCorrection")
+            {
+                if (!(ss >> m_cfg.faceYAngleXRotCorrection))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleSmileCorrection")
+            {
+                if (!(ss >> m_cfg.faceYAngleSmileCorrection))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleZeroValue")
+            {
+                if (!(ss >> m_cfg.faceYAngleZeroValue))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleUpThreshold")
+            {
+                if (!(ss >> m_cfg.faceYAngleUpThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "faceYAngleDownThreshold")
+            {
+                if (!(ss >> m_cfg.faceYAngleDownThreshold))
+                {
+                    throwConfigError(paramName, "double",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "autoBlink")
+            {
+                if (!(ss >> m_cfg.autoBlink))
+                {
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "autoBreath")
+            {
+                if (!(ss >> m_cfg.autoBreath))
+                {
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "randomMotion")
+            {
+                if (!(ss >> m_cfg.randomMotion))
+                {
+                    throwConfigError(paramName, "bool",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "paramBinding")
+            {
+                std::string name;
+                Binding binding;
+                if (!(ss >> name >> binding.cubismId))
+                {
+                    throwConfigError(paramName, "std::string std::string",
+                                     line, lineNum);
+                }
+
+                int i = 0;
+                while (i < NUM_PARAMS && name != paramNames[i])
+                {
+                    i++;
+                }
+                if (i == NUM_PARAMS)
+                {
+                    throwConfigError(paramName, "parameter name",
+                                     line, lineNum);
+                }
+                binding.param = static_cast<ParamIndex>(i);
+
+                // Bindings in the config file replace the default ones
+                if (!hasParamBindings)
+                {
+                    m_cfg.paramBindings.clear();
+                    hasParamBindings = true;
+                }
+                if (m_cfg.paramBindings.size() >= maxBindings)
                 {
                     std::ostringstream oss;
-                    oss << "Unrecognized parameter name at line " << lineNum
-                        << ": " << paramName;
+                    oss << "Too many parameter bindings at line " << lineNum
+                        << " (max " << maxBindings << ")";
                     throw std::runtime_error(oss.str());
                 }
+                m_cfg.paramBindings.push_back(binding);
+            }
+            else if (paramName == "threadCpuAffinity")
+            {
+                std::string cpuList;
+                if (!(ss >> cpuList) ||
+                    !parseCpuList(cpuList, m_cfg.threadCpuAffinity))
+                {
+                    throwConfigError(paramName, "CPU list",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "threadRealtimePriority")
+            {
+                if (!(ss >> m_cfg.threadRealtimePriority))
+                {
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "threadNiceness")
+            {
+                if (!(ss >> m_cfg.threadNiceness))
+                {
+                    throwConfigError(paramName, "int",
+                                     line, lineNum);
+                }
+            }
+            else if (paramName == "threadName")
+            {
+                if (!(ss >> m_cfg.threadName))
+                {
+                    throwConfigError(paramName, "std::string",
+                                     line, lineNum);
+                }
+            }
+            else
+            {
+                std::ostringstream oss;
+                oss << "Unrecognized parameter name at line " << lineNum
+                    << ": " << paramName;
+                throw std::runtime_error(oss.str());
             }
         }
     }
@@ -717,6 +2896,18 @@ void FacialLandmarkDetector::populateDefaultConfig(void)
 
     m_cfg.osfIpAddress = "127.0.0.1";
     m_cfg.osfPort = 11573;
+    m_cfg.osfExtraStreams.clear();
+    m_cfg.osfMulticastInterface = "";
+    m_cfg.osfReusePort = false;
+    m_cfg.osfRecvBufferSize = 0;
+    m_cfg.osfBusyPoll = 0;
+    m_cfg.osfKernelTimestamps = false;
+    m_cfg.osfFusionMaxSkew = 0.1;
+    m_cfg.motionSkipThreshold = 0;
+    m_cfg.featureSource = FEATURES_LANDMARKS;
+    m_cfg.rebroadcastAddress = "";
+    m_cfg.rebroadcastPort = 11574;
+    m_cfg.rebroadcastKeyframeInterval = 30;
     m_cfg.faceYAngleCorrection = 10;
     m_cfg.eyeSmileEyeOpenThreshold = 0.6;
     m_cfg.eyeSmileMouthFormThreshold = 0.75;
@@ -728,6 +2919,23 @@ void FacialLandmarkDetector::populateDefaultConfig(void)
     m_cfg.mouthOpenNumTaps = 3;
     m_cfg.leftEyeOpenNumTaps = 3;
     m_cfg.rightEyeOpenNumTaps = 3;
+    m_cfg.eyebrowNumTaps = 5;
+    m_cfg.faceXAngleMedianTaps = 0;
+    m_cfg.faceYAngleMedianTaps = 0;
+    m_cfg.faceZAngleMedianTaps = 0;
+    m_cfg.mouthFormMedianTaps = 0;
+    m_cfg.mouthOpenMedianTaps = 0;
+    m_cfg.leftEyeOpenMedianTaps = 0;
+    m_cfg.rightEyeOpenMedianTaps = 0;
+    m_cfg.eyebrowMedianTaps = 0;
+    m_cfg.faceXAngleHampelThreshold = 0;
+    m_cfg.faceYAngleHampelThreshold = 0;
+    m_cfg.faceZAngleHampelThreshold = 0;
+    m_cfg.mouthFormHampelThreshold = 0;
+    m_cfg.mouthOpenHampelThreshold = 0;
+    m_cfg.leftEyeOpenHampelThreshold = 0;
+    m_cfg.rightEyeOpenHampelThreshold = 0;
+    m_cfg.eyebrowHampelThreshold = 0;
     m_cfg.eyeClosedThreshold = 0.18;
     m_cfg.eyeOpenThreshold = 0.21;
     m_cfg.winkEnable = true;
@@ -736,6 +2944,12 @@ void FacialLandmarkDetector::populateDefaultConfig(void)
     m_cfg.mouthClosedThreshold = 0.1;
     m_cfg.mouthOpenThreshold = 0.4;
     m_cfg.mouthOpenLaughCorrection = 0.2;
+    m_cfg.osfEyeClosedThreshold = -0.8;
+    m_cfg.osfEyeOpenThreshold = -0.2;
+    m_cfg.osfMouthNormalThreshold = 0;
+    m_cfg.osfMouthSmileThreshold = 0.7;
+    m_cfg.osfMouthClosedThreshold = 0.1;
+    m_cfg.osfMouthOpenThreshold = 0.8;
     m_cfg.faceYAngleXRotCorrection = 0.15;
     m_cfg.faceYAngleSmileCorrection = 0.075;
     m_cfg.faceYAngleZeroValue = 1.8;
@@ -744,6 +2958,28 @@ void FacialLandmarkDetector::populateDefaultConfig(void)
     m_cfg.autoBlink = false;
     m_cfg.autoBreath = false;
     m_cfg.randomMotion = false;
+    m_cfg.threadCpuAffinity.clear();
+    m_cfg.threadRealtimePriority = 0;
+    m_cfg.threadNiceness = 0;
+    m_cfg.threadName = "flc-detector";
+    m_cfg.stateFile = "";
+    m_cfg.stateMaxAge = 10;
+    m_cfg.qualityWindow = 300;
+    m_cfg.qualityDumpPath = "";
+    m_cfg.qualityDumpInterval = 10;
+
+    // The standard Cubism 3+ parameter IDs
+    m_cfg.paramBindings = {
+        { PARAM_LEFT_EYE_OPENNESS, "ParamEyeLOpen" },
+        { PARAM_RIGHT_EYE_OPENNESS, "ParamEyeROpen" },
+        { PARAM_MOUTH_FORM, "ParamMouthForm" },
+        { PARAM_MOUTH_OPENNESS, "ParamMouthOpenY" },
+        { PARAM_LEFT_EYE_SMILE, "ParamEyeLSmile" },
+        { PARAM_RIGHT_EYE_SMILE, "ParamEyeRSmile" },
+        { PARAM_FACE_X_ANGLE, "ParamAngleX" },
+        { PARAM_FACE_Y_ANGLE, "ParamAngleY" },
+        { PARAM_FACE_Z_ANGLE, "ParamAngleZ" },
+    };
 }
 
 void FacialLandmarkDetector::throwConfigError(std::string paramName,
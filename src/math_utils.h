@@ -30,31 +30,14 @@ SOFTWARE.
 
 static const double PI = 3.14159265358979;
 
-template<class T>
-static double avg(T container, double defaultValue = 0)
-{
-    if (container.size() == 0)
-    {
-        return defaultValue;
-    }
-
-    double sum = 0;
-    for (auto it = container.begin(); it != container.end(); ++it)
-    {
-        sum += *it;
-    }
-    return sum / container.size();
-}
-
-
 template<class... Args>
-static Point centroid(Args&... args)
+static Point centroid(const Args&... args)
 {
     std::size_t numArgs = sizeof...(args);
     if (numArgs == 0) return Point(0, 0);
 
     double sumX = 0, sumY = 0;
-    for (auto point : {args...})
+    for (const Point& point : {args...})
     {
         sumX += point.x;
         sumY += point.y;
@@ -88,7 +71,7 @@ static inline double degToRad(double deg)
     return deg * PI / 180;
 }
 
-double dist(Point& p1, Point& p2)
+double dist(const Point& p1, const Point& p2)
 {
     double xDist = p1.x - p2.x;
     double yDist = p1.y - p2.y;
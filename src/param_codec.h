@@ -0,0 +1,278 @@
+// -*- mode: c++ -*-
+
+#ifndef FACE_DETECTOR_PARAM_CODEC_H
+#define FACE_DETECTOR_PARAM_CODEC_H
+
+/****
+Copyright (c) 2020-2021 Adrian I. Lam
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+****/
+
+
+/* Compact packet format used to rebroadcast the processed parameters
+ * (see rebroadcastAddress in the config file) to ParamReceiver.
+ *
+ * All integers are little-endian.
+ *
+ *   0  4 bytes  magic "FLC1"
+ *   4  uint32   sequence number, incremented for every packet
+ *   8  uint8    flags (PARAM_PACKET_*)
+ *   9  uint8    number of parameters n, in ParamIndex order
+ *  10           n variable-length integers (zigzag LEB128)
+ *
+ * Each parameter is quantized with paramQuantStep(). In a keyframe the
+ * integers are the quantized values; otherwise they are the differences
+ * from the previous packet, which are small (one byte) unless the face
+ * moves quickly. A receiver that misses a packet waits for the next
+ * keyframe.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+#include "facial_landmark_detector.h"
+
+enum ParamPacketFlags
+{
+    PARAM_PACKET_KEYFRAME = 1 << 0,
+    PARAM_PACKET_AUTO_BLINK = 1 << 1,
+    PARAM_PACKET_AUTO_BREATH = 1 << 2,
+    PARAM_PACKET_RANDOM_MOTION = 1 << 3
+};
+
+static const std::size_t paramPacketHeaderSize = 10;
+static const std::size_t paramPacketMaxSize =
+    paramPacketHeaderSize + 5 * FacialLandmarkDetector::NUM_PARAMS;
+
+/*! Size of one quantization step of each parameter */
+static inline double paramQuantStep(int param)
+{
+    switch (param)
+    {
+    case FacialLandmarkDetector::PARAM_FACE_X_ANGLE:
+    case FacialLandmarkDetector::PARAM_FACE_Y_ANGLE:
+    case FacialLandmarkDetector::PARAM_FACE_Z_ANGLE:
+        return 0.01; // degrees
+    default:
+        return 0.001;
+    }
+}
+
+static inline void paramsToValues(const FacialLandmarkDetector::Params& params,
+                                  double values[])
+{
+    values[FacialLandmarkDetector::PARAM_LEFT_EYE_OPENNESS] = params.leftEyeOpenness;
+    values[FacialLandmarkDetector::PARAM_RIGHT_EYE_OPENNESS] = params.rightEyeOpenness;
+    values[FacialLandmarkDetector::PARAM_LEFT_EYE_SMILE] = params.leftEyeSmile;
+    values[FacialLandmarkDetector::PARAM_RIGHT_EYE_SMILE] = params.rightEyeSmile;
+    values[FacialLandmarkDetector::PARAM_MOUTH_OPENNESS] = params.mouthOpenness;
+    values[FacialLandmarkDetector::PARAM_MOUTH_FORM] = params.mouthForm;
+    values[FacialLandmarkDetector::PARAM_FACE_X_ANGLE] = params.faceXAngle;
+    values[FacialLandmarkDetector::PARAM_FACE_Y_ANGLE] = params.faceYAngle;
+    values[FacialLandmarkDetector::PARAM_FACE_Z_ANGLE] = params.faceZAngle;
+    values[FacialLandmarkDetector::PARAM_LEFT_EYEBROW_UP_DOWN] = params.leftEyebrowUpDown;
+    values[FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_UP_DOWN] = params.rightEyebrowUpDown;
+    values[FacialLandmarkDetector::PARAM_LEFT_EYEBROW_ANGLE] = params.leftEyebrowAngle;
+    values[FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_ANGLE] = params.rightEyebrowAngle;
+}
+
+static inline void valuesToParams(const double values[],
+                                  FacialLandmarkDetector::Params& params)
+{
+    params.leftEyeOpenness = values[FacialLandmarkDetector::PARAM_LEFT_EYE_OPENNESS];
+    params.rightEyeOpenness = values[FacialLandmarkDetector::PARAM_RIGHT_EYE_OPENNESS];
+    params.leftEyeSmile = values[FacialLandmarkDetector::PARAM_LEFT_EYE_SMILE];
+    params.rightEyeSmile = values[FacialLandmarkDetector::PARAM_RIGHT_EYE_SMILE];
+    params.mouthOpenness = values[FacialLandmarkDetector::PARAM_MOUTH_OPENNESS];
+    params.mouthForm = values[FacialLandmarkDetector::PARAM_MOUTH_FORM];
+    params.faceXAngle = values[FacialLandmarkDetector::PARAM_FACE_X_ANGLE];
+    params.faceYAngle = values[FacialLandmarkDetector::PARAM_FACE_Y_ANGLE];
+    params.faceZAngle = values[FacialLandmarkDetector::PARAM_FACE_Z_ANGLE];
+    params.leftEyebrowUpDown = values[FacialLandmarkDetector::PARAM_LEFT_EYEBROW_UP_DOWN];
+    params.rightEyebrowUpDown = values[FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_UP_DOWN];
+    params.leftEyebrowAngle = values[FacialLandmarkDetector::PARAM_LEFT_EYEBROW_ANGLE];
+    params.rightEyebrowAngle = values[FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_ANGLE];
+}
+
+static inline std::size_t putVarint(unsigned char *buf, std::int32_t value)
+{
+    // Zigzag, so that small negative numbers are small too
+    std::uint32_t u = (static_cast<std::uint32_t>(value) << 1) ^
+                      static_cast<std::uint32_t>(value >> 31);
+    std::size_t n = 0;
+    while (u >= 0x80)
+    {
+        buf[n++] = static_cast<unsigned char>(u | 0x80);
+        u >>= 7;
+    }
+    buf[n++] = static_cast<unsigned char>(u);
+    return n;
+}
+
+/*! Returns the number of bytes read, or 0 if buf is too short */
+static inline std::size_t getVarint(const unsigned char *buf, std::size_t size,
+                                    std::int32_t& value)
+{
+    std::uint32_t u = 0;
+    for (std::size_t n = 0; n < size && n < 5; n++)
+    {
+        u |= static_cast<std::uint32_t>(buf[n] & 0x7f) << (7 * n);
+        if (!(buf[n] & 0x80))
+        {
+            value = static_cast<std::int32_t>((u >> 1) ^ (~(u & 1) + 1));
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static inline void putUint32(unsigned char *buf, std::uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buf[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+static inline std::uint32_t getUint32(const unsigned char *buf)
+{
+    std::uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        value |= static_cast<std::uint32_t>(buf[i]) << (8 * i);
+    }
+    return value;
+}
+
+/*! Encode a packet into buf, which must hold paramPacketMaxSize bytes.
+ *  quantized holds the values of the previous packet (ignored for a
+ *  keyframe), and is updated to those of this one.
+ *  Returns the size of the packet.
+ */
+static inline std::size_t encodeParamPacket(const FacialLandmarkDetector::Params& params,
+                                            std::uint32_t sequence,
+                                            bool keyframe,
+                                            std::int32_t quantized[],
+                                            unsigned char *buf)
+{
+    const int numParams = FacialLandmarkDetector::NUM_PARAMS;
+
+    buf[0] = 'F';
+    buf[1] = 'L';
+    buf[2] = 'C';
+    buf[3] = '1';
+    putUint32(buf + 4, sequence);
+    buf[8] = (keyframe ? PARAM_PACKET_KEYFRAME : 0) |
+             (params.autoBlink ? PARAM_PACKET_AUTO_BLINK : 0) |
+             (params.autoBreath ? PARAM_PACKET_AUTO_BREATH : 0) |
+             (params.randomMotion ? PARAM_PACKET_RANDOM_MOTION : 0);
+    buf[9] = numParams;
+
+    double values[numParams];
+    paramsToValues(params, values);
+
+    std::size_t size = paramPacketHeaderSize;
+    for (int i = 0; i < numParams; i++)
+    {
+        std::int32_t q = static_cast<std::int32_t>(
+            std::lround(values[i] / paramQuantStep(i)));
+        size += putVarint(buf + size, keyframe ? q : q - quantized[i]);
+        quantized[i] = q;
+    }
+
+    return size;
+}
+
+/*! Header fields of a packet, as read by parseParamPacketHeader() */
+struct ParamPacketHeader
+{
+    std::uint32_t sequence;
+    unsigned int flags;
+    unsigned int numParams;
+};
+
+static inline bool parseParamPacketHeader(const unsigned char *buf,
+                                          std::size_t size,
+                                          ParamPacketHeader& header)
+{
+    if (size < paramPacketHeaderSize ||
+        buf[0] != 'F' || buf[1] != 'L' || buf[2] != 'C' || buf[3] != '1')
+    {
+        return false;
+    }
+
+    header.sequence = getUint32(buf + 4);
+    header.flags = buf[8];
+    header.numParams = buf[9];
+    return true;
+}
+
+/*! Decode the parameter values of a packet whose header has been parsed.
+ *  quantized holds the values of the previous packet (ignored for a
+ *  keyframe), and is updated to those of this one. Parameters unknown to
+ *  this version are skipped.
+ */
+static inline bool decodeParamPacket(const unsigned char *buf,
+                                     std::size_t size,
+                                     const ParamPacketHeader& header,
+                                     std::int32_t quantized[],
+                                     FacialLandmarkDetector::Params& params)
+{
+    const int numParams = FacialLandmarkDetector::NUM_PARAMS;
+    bool keyframe = header.flags & PARAM_PACKET_KEYFRAME;
+
+    std::int32_t newQuantized[numParams];
+    std::size_t pos = paramPacketHeaderSize;
+    for (unsigned int i = 0; i < header.numParams; i++)
+    {
+        std::int32_t v;
+        std::size_t n = getVarint(buf + pos, size - pos, v);
+        if (n == 0)
+        {
+            return false;
+        }
+        pos += n;
+
+        if (i < static_cast<unsigned int>(numParams))
+        {
+            newQuantized[i] = keyframe ? v : quantized[i] + v;
+        }
+    }
+
+    double values[numParams];
+    for (int i = 0; i < numParams; i++)
+    {
+        if (i >= static_cast<int>(header.numParams))
+        {
+            newQuantized[i] = 0;
+        }
+        quantized[i] = newQuantized[i];
+        values[i] = quantized[i] * paramQuantStep(i);
+    }
+
+    valuesToParams(values, params);
+    params.autoBlink = header.flags & PARAM_PACKET_AUTO_BLINK;
+    params.autoBreath = header.flags & PARAM_PACKET_AUTO_BREATH;
+    params.randomMotion = header.flags & PARAM_PACKET_RANDOM_MOTION;
+    return true;
+}
+
+#endif
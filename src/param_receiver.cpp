@@ -0,0 +1,223 @@
+/****
+Copyright (c) 2020-2021 Adrian I. Lam
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+****/
+
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#   include <WinSock2.h>
+#   include <ws2tcpip.h>
+#else
+#   include <sys/types.h>
+#   include <sys/socket.h>
+#   include <sys/time.h>
+#   include <sys/select.h>
+#   include <arpa/inet.h>
+#   include <unistd.h>
+#endif
+
+#include "param_receiver.h"
+#include "param_codec.h"
+
+static const int recvTimeoutMs = 100;
+
+// Packets arriving at most this far behind the latest one are taken to be
+// reordered; further back, the sender must have restarted
+static const std::int32_t maxReorder = 64;
+
+ParamReceiver::ParamReceiver(std::string ipAddress, int port)
+    : m_sock(-1), m_stop(false), m_synced(false), m_lastSequence(0),
+      m_quantized(), m_params(), m_stats()
+{
+    m_params.leftEyeOpenness = 1;
+    m_params.rightEyeOpenness = 1;
+
+#ifdef _WIN32 // WinSock2 should be initialized before using
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        throw std::runtime_error("Cannot initialize WinSock");
+    }
+#endif
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ipAddress.c_str());
+
+    m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_sock < 0)
+    {
+        throw std::runtime_error("Cannot create UDP socket");
+    }
+
+    if (bind(m_sock, (struct sockaddr *)&addr, sizeof addr) != 0)
+    {
+#ifdef _WIN32
+        closesocket(m_sock);
+#else
+        close(m_sock);
+#endif
+        throw std::runtime_error("Cannot bind socket to port " +
+                                 std::to_string(port));
+    }
+}
+
+ParamReceiver::~ParamReceiver()
+{
+    stop();
+
+#ifdef _WIN32
+    closesocket(m_sock);
+#else
+    close(m_sock);
+#endif
+}
+
+FacialLandmarkDetector::Params ParamReceiver::getParams(void) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_params;
+}
+
+ParamReceiver::Stats ParamReceiver::getStats(void) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void ParamReceiver::start(void)
+{
+    if (m_thread.joinable())
+    {
+        return;
+    }
+
+    m_stop = false;
+    m_thread = std::thread(&ParamReceiver::mainLoop, this);
+}
+
+void ParamReceiver::stop(void)
+{
+    m_stop = true;
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+void ParamReceiver::mainLoop(void)
+{
+    unsigned char buf[paramPacketMaxSize + 64];
+
+    while (!m_stop)
+    {
+        // Wake up periodically so that stop() does not block forever
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        FD_SET(m_sock, &readFds);
+
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = recvTimeoutMs * 1000;
+
+        if (select(m_sock + 1, &readFds, nullptr, nullptr, &timeout) <= 0)
+        {
+            continue;
+        }
+
+        auto recvSize = recv(m_sock, (char *)buf, sizeof buf, 0);
+        if (recvSize > 0)
+        {
+            processPacket(buf, recvSize);
+        }
+    }
+}
+
+void ParamReceiver::processPacket(const unsigned char *buf, std::size_t size)
+{
+    ParamPacketHeader header;
+    if (!parseParamPacketHeader(buf, size, header))
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.numRejected++;
+        return;
+    }
+
+    bool keyframe = header.flags & PARAM_PACKET_KEYFRAME;
+    std::int32_t gap = static_cast<std::int32_t>(header.sequence - m_lastSequence);
+    bool reset = false;
+
+    if (m_synced && gap <= 0)
+    {
+        if (gap >= -maxReorder)
+        {
+            // Duplicated or reordered packet, which we have already
+            // superseded. This goes for keyframes too: a late one would
+            // roll the parameters back.
+            return;
+        }
+        else if (!keyframe)
+        {
+            // A delta from a restarted sender: wait for its next keyframe
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.numResets++;
+            m_stats.numRejected++;
+            m_synced = false;
+            return;
+        }
+
+        // The sender restarted and counts from 0 again: resync right away
+        reset = true;
+    }
+
+    std::uint64_t lost = 0;
+    if (m_synced && gap > 1)
+    {
+        lost = gap - 1;
+        m_synced = false;
+    }
+
+    // A delta can only be applied on top of the packet right before it
+    FacialLandmarkDetector::Params params;
+    bool applied = (keyframe || m_synced) &&
+                   decodeParamPacket(buf, size, header, m_quantized, params);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.numLost += lost;
+    if (reset)
+    {
+        m_stats.numResets++;
+    }
+    if (applied)
+    {
+        m_synced = true;
+        m_lastSequence = header.sequence;
+        m_params = params;
+        m_stats.numPackets++;
+    }
+    else
+    {
+        m_stats.numRejected++;
+    }
+}
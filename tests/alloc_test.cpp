@@ -0,0 +1,275 @@
+// Checks that, once warmed up, the per-frame path of the detector does
+// not touch the heap: processing a frame (offline and from a socket,
+// including rebroadcasting and the periodic quality dump) and reading the
+// parameters with getParams(), getParamArray() and getQualityStats().
+//
+// Global operator new, and on glibc malloc itself, are replaced by
+// versions that count the allocations made while counting is enabled,
+// from any thread. Fails if there are any.
+//
+// Usage: alloc_test [PORT]
+// PORT and PORT + 1 on 127.0.0.1 are used for the socket test.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "facial_landmark_detector.h"
+#include "osf_packet.h"
+
+static std::atomic<bool> g_counting(false);
+static std::atomic<unsigned long> g_numAllocs(0);
+
+static void countAlloc(void)
+{
+    if (g_counting)
+    {
+        g_numAllocs++;
+    }
+}
+
+#ifdef __GLIBC__
+// glibc allows replacing malloc by defining it in the program
+extern "C" void *__libc_malloc(std::size_t size);
+extern "C" void *__libc_calloc(std::size_t num, std::size_t size);
+extern "C" void *__libc_realloc(void *ptr, std::size_t size);
+extern "C" void __libc_free(void *ptr);
+
+extern "C" void *malloc(std::size_t size) noexcept
+{
+    countAlloc();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(std::size_t num, std::size_t size) noexcept
+{
+    countAlloc();
+    return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, std::size_t size) noexcept
+{
+    countAlloc();
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) noexcept
+{
+    __libc_free(ptr);
+}
+
+static void *rawMalloc(std::size_t size)
+{
+    return __libc_malloc(size);
+}
+#else
+static void *rawMalloc(std::size_t size)
+{
+    return std::malloc(size);
+}
+#endif
+
+void *operator new(std::size_t size)
+{
+    countAlloc();
+    void *ptr = rawMalloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    countAlloc();
+    return rawMalloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static const int warmupFrames = 100;
+static const int numFrames = 500;
+
+static void startCounting(void)
+{
+    g_numAllocs = 0;
+    g_counting = true;
+}
+
+static unsigned long stopCounting(void)
+{
+    g_counting = false;
+    return g_numAllocs;
+}
+
+/*! Everything a renderer reads once per frame */
+static void readParams(const FacialLandmarkDetector& detector)
+{
+    FacialLandmarkDetector::ParamArray paramArray;
+    detector.getParams();
+    detector.getParamArray(paramArray);
+    detector.getQualityStats(FacialLandmarkDetector::PARAM_FACE_X_ANGLE);
+}
+
+/*! Replay frames into an offline detector, feeding every frame to each
+ *  of numStreams streams. Returns the allocations after warm-up.
+ */
+static unsigned long replayOffline(const std::string& cfg, std::size_t numStreams)
+{
+    FacialLandmarkDetector detector("", FacialLandmarkDetector::INPUT_OFFLINE, cfg);
+    std::vector<char> buf(FacialLandmarkDetector::osfPacketSize);
+
+    for (int frame = 0; frame < warmupFrames + numFrames; frame++)
+    {
+        if (frame == warmupFrames)
+        {
+            startCounting();
+        }
+
+        makeOsfPacket(buf.data(), frame / 30.0, frame * 0.1);
+        for (std::size_t i = 0; i < numStreams; i++)
+        {
+            detector.processPacket(buf.data(), buf.size(), i);
+        }
+        readParams(detector);
+    }
+
+    return stopCounting();
+}
+
+/*! Send frames over loopback to a detector running in its own thread.
+ *  Returns the allocations after warm-up, or -1 if nothing arrived or
+ *  no quality dump was written.
+ */
+static long replaySocket(int port)
+{
+    std::string dumpPath = "/tmp/flc_alloc_test_" + std::to_string(getpid()) + ".txt";
+    std::string cfg = "osfIpAddress 127.0.0.1\n"
+                      "osfPort " + std::to_string(port) + "\n"
+                      "osfKernelTimestamps 1\n"
+                      "rebroadcastAddress 127.0.0.1\n"
+                      "rebroadcastPort " + std::to_string(port + 1) + "\n"
+                      "qualityDumpPath " + dumpPath + "\n"
+                      "qualityDumpInterval 0.05\n";
+    FacialLandmarkDetector detector("", FacialLandmarkDetector::INPUT_SOCKET, cfg);
+    detector.start();
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    std::vector<char> buf(FacialLandmarkDetector::osfPacketSize);
+    for (int frame = 0; frame < warmupFrames + numFrames; frame++)
+    {
+        if (frame == warmupFrames)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            startCounting();
+        }
+
+        makeOsfPacket(buf.data(), frame / 30.0, frame * 0.1);
+        sendto(sock, buf.data(), buf.size(), 0,
+               (struct sockaddr *)&addr, sizeof addr);
+        readParams(detector);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Let the detector catch up before counting stops
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    unsigned long numAllocs = stopCounting();
+
+    close(sock);
+    bool received = detector.getThreadStats().numFrames > warmupFrames;
+    detector.stop();
+    bool dumped = std::remove(dumpPath.c_str()) == 0;
+    return received && dumped ? static_cast<long>(numAllocs) : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? std::atoi(argv[1]) : 12573;
+    bool ok = true;
+
+    struct
+    {
+        const char *name;
+        const char *cfg;
+        std::size_t numStreams;
+    } offlineCases[] = {
+        { "default config", "", 1 },
+        { "median and Hampel filters",
+          "faceXAngleMedianTaps 5\nfaceYAngleMedianTaps 4\n"
+          "faceZAngleMedianTaps 3\nmouthFormMedianTaps 5\n"
+          "mouthOpenMedianTaps 5\nleftEyeOpenMedianTaps 3\n"
+          "rightEyeOpenMedianTaps 3\neyebrowMedianTaps 5\n"
+          "faceXAngleHampelThreshold 3\nmouthOpenHampelThreshold 2\n"
+          "eyebrowHampelThreshold 3\n", 1 },
+        { "OSF features and motion skipping",
+          "featureSource osf\nmotionSkipThreshold 0.01\n", 1 },
+        { "two fused streams",
+          "osfExtraStream 11574 -45\n", 2 },
+    };
+
+    for (const auto& c : offlineCases)
+    {
+        unsigned long numAllocs = replayOffline(c.cfg, c.numStreams);
+        std::printf("offline, %s: %lu allocations in %d frames\n",
+                    c.name, numAllocs, numFrames);
+        ok = ok && numAllocs == 0;
+    }
+
+    long numAllocs = replaySocket(port);
+    if (numAllocs < 0)
+    {
+        std::printf("socket: no frames received, or no quality dump\n");
+        ok = false;
+    }
+    else
+    {
+        std::printf("socket: %ld allocations in %d frames\n", numAllocs, numFrames);
+        ok = ok && numAllocs == 0;
+    }
+
+    std::printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+// Loopback test of multicast fan-out: two detectors join the same IPv4
+// group on 127.0.0.1 (osfMulticastInterface), and each must receive every
+// packet from a single sender.
+//
+// Some hosts cannot do multicast on the loopback interface at all (e.g.
+// without a route for it). This is probed first with plain sockets, and
+// the test is skipped (exit code 77) if it does not work there. Note that
+// Linux delivers IPv4 multicast on lo even though lo lacks the MULTICAST
+// flag, so the flag alone does not tell.
+//
+// Usage: multicast_test [PORT]
+// PORT and PORT + 1 are used on the group 239.7.7.7.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "facial_landmark_detector.h"
+#include "osf_packet.h"
+
+static const char *const group = "239.7.7.7";
+static const char *const iface = "127.0.0.1";
+static const int skipExitCode = 77;
+
+/*! A socket that sends to the group over loopback */
+static int openSender(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct in_addr ifaceAddr;
+    ifaceAddr.s_addr = inet_addr(iface);
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaceAddr, sizeof ifaceAddr);
+    return sock;
+}
+
+static struct sockaddr_in groupAddr(int port)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(group);
+    return addr;
+}
+
+/*! Whether a packet sent to the group on lo comes back to a member */
+static bool probeMulticast(int port)
+{
+    int recvSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = groupAddr(port);
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface.s_addr = inet_addr(iface);
+
+    bool ok = bind(recvSock, (struct sockaddr *)&addr, sizeof addr) == 0 &&
+              setsockopt(recvSock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                         &mreq, sizeof mreq) == 0;
+
+    int sendSock = openSender();
+    char byte = 0;
+    ok = ok && sendto(sendSock, &byte, 1, 0, (struct sockaddr *)&addr, sizeof addr) == 1;
+
+    if (ok)
+    {
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        FD_SET(recvSock, &readFds);
+        struct timeval timeout = { 0, 500000 };
+        ok = select(recvSock + 1, &readFds, nullptr, nullptr, &timeout) == 1;
+    }
+
+    close(sendSock);
+    close(recvSock);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? std::atoi(argv[1]) : 12590;
+
+    if (!probeMulticast(port))
+    {
+        std::printf("SKIP: no multicast on the loopback interface\n");
+        return skipExitCode;
+    }
+
+    std::string cfg = std::string("osfIpAddress ") + group + "\n"
+                      "osfPort " + std::to_string(port + 1) + "\n"
+                      "osfMulticastInterface " + iface + "\n";
+    FacialLandmarkDetector first("", FacialLandmarkDetector::INPUT_SOCKET, cfg);
+    FacialLandmarkDetector second("", FacialLandmarkDetector::INPUT_SOCKET, cfg);
+    first.start();
+    second.start();
+
+    const std::uint64_t numFrames = 10;
+    int sock = openSender();
+    struct sockaddr_in addr = groupAddr(port + 1);
+    std::vector<char> buf(FacialLandmarkDetector::osfPacketSize);
+    for (std::uint64_t frame = 0; frame < numFrames; frame++)
+    {
+        makeOsfPacket(buf.data(), frame / 30.0, frame * 0.1);
+        sendto(sock, buf.data(), buf.size(), 0, (struct sockaddr *)&addr, sizeof addr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    close(sock);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while ((first.getThreadStats().numFrames < numFrames ||
+            second.getThreadStats().numFrames < numFrames) &&
+           std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::uint64_t firstFrames = first.getThreadStats().numFrames;
+    std::uint64_t secondFrames = second.getThreadStats().numFrames;
+    first.stop();
+    second.stop();
+
+    bool ok = firstFrames == numFrames && secondFrames == numFrames;
+    std::printf("sent %llu frames, received %llu and %llu\n%s\n",
+                (unsigned long long)numFrames, (unsigned long long)firstFrames,
+                (unsigned long long)secondFrames, ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Synthetic OSF packets for the tests.
+
+#ifndef OSF_PACKET_H
+#define OSF_PACKET_H
+
+#include <cmath>
+#include <cstring>
+
+#include "facial_landmark_detector.h"
+
+// Same layout as in facial_landmark_detector.cpp
+static const int osfConfidenceOffset = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                     + 4 * 4;
+static const int osfLandmarksOffset = osfConfidenceOffset + 4 * 68;
+static const int osfFeaturesOffset =
+    static_cast<int>(FacialLandmarkDetector::osfPacketSize) - 4 * 14;
+
+static void putFloat(char *buf, int offset, double value)
+{
+    float f = static_cast<float>(value);
+    std::memcpy(buf + offset, &f, sizeof f);
+}
+
+/*! A face looking roughly at the camera, blinking, talking and jittering
+ *  a little with t. buf must hold FacialLandmarkDetector::osfPacketSize
+ *  bytes.
+ */
+static void makeOsfPacket(char *buf, double timestamp, double t)
+{
+    std::memset(buf, 0, FacialLandmarkDetector::osfPacketSize);
+    std::memcpy(buf, &timestamp, sizeof timestamp);
+    // Face ID 0 at offset 8, as set by the memset
+
+    double pts[68][2];
+    for (int i = 0; i < 17; i++) // Jaw
+    {
+        pts[i][0] = 100 + i * 12.5;
+        pts[i][1] = 150 + 60 * std::sin(i / 16.0 * 3.14159265358979);
+    }
+    for (int i = 17; i < 27; i++) // Eyebrows
+    {
+        pts[i][0] = 120 + (i - 17) * 16;
+        pts[i][1] = 120 - 2 * std::sin(t * 0.3);
+    }
+    for (int i = 27; i < 31; i++) // Nose bridge
+    {
+        pts[i][0] = 200;
+        pts[i][1] = 140 + (i - 27) * 12;
+    }
+    pts[30][1] = 180;
+    for (int i = 31; i < 36; i++) // Nostrils
+    {
+        pts[i][0] = 185 + (i - 31) * 7.5;
+        pts[i][1] = 190;
+    }
+    double eyeOpen = 4 + 2 * std::sin(t);
+    const double eye[6][2] = {
+        { 140, 140 }, { 150, 140 - eyeOpen }, { 160, 140 - eyeOpen },
+        { 170, 140 }, { 160, 140 + eyeOpen }, { 150, 140 + eyeOpen }
+    };
+    for (int i = 0; i < 6; i++)
+    {
+        pts[36 + i][0] = eye[i][0];
+        pts[36 + i][1] = eye[i][1];
+        pts[42 + i][0] = eye[i][0] + 90;
+        pts[42 + i][1] = eye[i][1];
+    }
+    for (int i = 48; i < 68; i++) // Mouth
+    {
+        double angle = (i - 48) / 20.0 * 2 * 3.14159265358979;
+        pts[i][0] = 200 + 30 * std::cos(angle);
+        pts[i][1] = 215 + (5 + 3 * std::sin(t * 0.7)) * std::sin(angle);
+    }
+
+    for (int i = 0; i < 68; i++)
+    {
+        putFloat(buf, osfConfidenceOffset + 4 * i, 0.9);
+        putFloat(buf, osfLandmarksOffset + 8 * i, pts[i][0] + 0.5 * std::sin(t * 3 + i));
+        putFloat(buf, osfLandmarksOffset + 8 * i + 4, pts[i][1]);
+    }
+
+    // OSF's own features: eyes, eyebrows, mouth
+    putFloat(buf, osfFeaturesOffset + 4 * 0, 0.5 + 0.4 * std::sin(t));
+    putFloat(buf, osfFeaturesOffset + 4 * 1, 0.5 + 0.4 * std::sin(t));
+    for (int i = 2; i < 8; i++)
+    {
+        putFloat(buf, osfFeaturesOffset + 4 * i, 0.2 * std::sin(t * 0.3 + i));
+    }
+    for (int i = 8; i < 12; i++)
+    {
+        putFloat(buf, osfFeaturesOffset + 4 * i, 0.1 * std::cos(t * 0.5 + i));
+    }
+    putFloat(buf, osfFeaturesOffset + 4 * 12, 0.3 + 0.3 * std::sin(t * 0.7));
+    putFloat(buf, osfFeaturesOffset + 4 * 13, 0.1);
+}
+
+#endif
@@ -0,0 +1,317 @@
+// Loopback test of the parameter rebroadcast (param_codec.h) and
+// ParamReceiver.
+//
+// First a detector rebroadcasts to a receiver, which must end up with the
+// same parameters. Then packets are sent directly, to check that the
+// receiver holds its values over lost packets until the next keyframe,
+// ignores duplicates, and follows a sender that restarts with its
+// sequence numbers back at 0.
+//
+// Usage: param_receiver_test [PORT]
+// PORT to PORT + 2 on 127.0.0.1 are used.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "facial_landmark_detector.h"
+#include "param_receiver.h"
+#include "../src/param_codec.h"
+#include "osf_packet.h"
+
+static bool g_ok = true;
+
+static void check(bool cond, const char *what)
+{
+    std::printf("%s: %s\n", cond ? "ok" : "FAILED", what);
+    g_ok = g_ok && cond;
+}
+
+static bool sameParams(const FacialLandmarkDetector::Params& a,
+                       const FacialLandmarkDetector::Params& b)
+{
+    double va[FacialLandmarkDetector::NUM_PARAMS];
+    double vb[FacialLandmarkDetector::NUM_PARAMS];
+    paramsToValues(a, va);
+    paramsToValues(b, vb);
+    for (int i = 0; i < FacialLandmarkDetector::NUM_PARAMS; i++)
+    {
+        // Within one quantization step
+        if (std::abs(va[i] - vb[i]) > paramQuantStep(i))
+        {
+            return false;
+        }
+    }
+    return a.autoBlink == b.autoBlink && a.autoBreath == b.autoBreath &&
+           a.randomMotion == b.randomMotion;
+}
+
+/*! Wait until the receiver has handled the given number of packets,
+ *  applied or rejected.
+ */
+static ParamReceiver::Stats waitForPackets(const ParamReceiver& receiver,
+                                           std::uint64_t numPackets)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    ParamReceiver::Stats stats = receiver.getStats();
+    while (stats.numPackets + stats.numRejected < numPackets &&
+           std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stats = receiver.getStats();
+    }
+    return stats;
+}
+
+/*! Sends packets the way the detector does, but lets the test drop,
+ *  repeat and restart them.
+ */
+class Sender
+{
+public:
+    Sender(int port, int keyframeInterval)
+        : m_sock(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)),
+          m_keyframeInterval(keyframeInterval), m_sequence(0), m_quantized(),
+          m_size(0), m_savedSize(0)
+    {
+        m_addr = {};
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    }
+
+    ~Sender()
+    {
+        close(m_sock);
+    }
+
+    /*! Encode the next packet; send it unless it is to be "lost" */
+    void send(const FacialLandmarkDetector::Params& params, bool lose = false)
+    {
+        bool keyframe = m_sequence % m_keyframeInterval == 0;
+        m_size = encodeParamPacket(params, m_sequence, keyframe, m_quantized, m_buf);
+        m_sequence++;
+        if (!lose)
+        {
+            resend();
+        }
+    }
+
+    /*! Send the last packet again */
+    void resend(void)
+    {
+        sendto(m_sock, (const char *)m_buf, m_size, 0,
+               (struct sockaddr *)&m_addr, sizeof m_addr);
+    }
+
+    /*! Keep a copy of the last packet, to send it late with sendSaved() */
+    void save(void)
+    {
+        std::memcpy(m_saved, m_buf, m_size);
+        m_savedSize = m_size;
+    }
+
+    void sendSaved(void)
+    {
+        sendto(m_sock, (const char *)m_saved, m_savedSize, 0,
+               (struct sockaddr *)&m_addr, sizeof m_addr);
+    }
+
+    /*! Start again from sequence number 0, as after a restart */
+    void restart(void)
+    {
+        m_sequence = 0;
+    }
+
+private:
+    int m_sock;
+    struct sockaddr_in m_addr;
+    int m_keyframeInterval;
+    std::uint32_t m_sequence;
+    std::int32_t m_quantized[FacialLandmarkDetector::NUM_PARAMS];
+    unsigned char m_buf[paramPacketMaxSize];
+    std::size_t m_size;
+    unsigned char m_saved[paramPacketMaxSize];
+    std::size_t m_savedSize;
+};
+
+static FacialLandmarkDetector::Params makeParams(double t)
+{
+    FacialLandmarkDetector::Params params = {};
+    double values[FacialLandmarkDetector::NUM_PARAMS];
+    for (int i = 0; i < FacialLandmarkDetector::NUM_PARAMS; i++)
+    {
+        bool isAngle = i >= FacialLandmarkDetector::PARAM_FACE_X_ANGLE &&
+                       i <= FacialLandmarkDetector::PARAM_FACE_Z_ANGLE;
+        values[i] = (isAngle ? 30 : 1) * std::sin(t + i);
+    }
+    valuesToParams(values, params);
+    params.autoBreath = true;
+    return params;
+}
+
+static void testDetector(int port)
+{
+    ParamReceiver receiver("127.0.0.1", port + 1);
+    receiver.start();
+
+    std::string cfg = "osfIpAddress 127.0.0.1\n"
+                      "osfPort " + std::to_string(port) + "\n"
+                      "rebroadcastAddress 127.0.0.1\n"
+                      "rebroadcastPort " + std::to_string(port + 1) + "\n"
+                      "rebroadcastKeyframeInterval 10\n";
+    FacialLandmarkDetector detector("", FacialLandmarkDetector::INPUT_SOCKET, cfg);
+    detector.start();
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    const int numFrames = 100;
+    std::vector<char> buf(FacialLandmarkDetector::osfPacketSize);
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        makeOsfPacket(buf.data(), frame / 30.0, frame * 0.1);
+        sendto(sock, buf.data(), buf.size(), 0, (struct sockaddr *)&addr, sizeof addr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    close(sock);
+
+    ParamReceiver::Stats stats = waitForPackets(receiver, numFrames);
+    detector.stop();
+    receiver.stop();
+
+    check(stats.numPackets == numFrames && stats.numLost == 0,
+          "detector: every frame arrives");
+    check(sameParams(receiver.getParams(), detector.getParams()),
+          "detector: receiver has the detector's parameters");
+}
+
+static void testLossAndRestart(int port)
+{
+    ParamReceiver receiver("127.0.0.1", port);
+    receiver.start();
+    Sender sender(port, 10);
+    std::uint64_t numSent = 0;
+
+    // In order
+    FacialLandmarkDetector::Params params;
+    for (int i = 0; i < 25; i++)
+    {
+        params = makeParams(i * 0.1);
+        sender.send(params);
+        numSent++;
+    }
+    ParamReceiver::Stats stats = waitForPackets(receiver, numSent);
+    check(stats.numPackets == numSent && sameParams(receiver.getParams(), params),
+          "in order: every packet applied");
+
+    // A duplicate is ignored
+    sender.resend();
+    sender.send(params = makeParams(25 * 0.1));
+    numSent++;
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numPackets == numSent && stats.numRejected == 0 &&
+          sameParams(receiver.getParams(), params),
+          "duplicate: ignored");
+
+    // Losing packets 26 and 27 holds the values of 25 (the deltas after
+    // the gap are rejected) until the keyframe at 30
+    FacialLandmarkDetector::Params held = params;
+    sender.send(makeParams(26 * 0.1), true);
+    sender.send(makeParams(27 * 0.1), true);
+    sender.send(makeParams(28 * 0.1));
+    sender.send(makeParams(29 * 0.1));
+    numSent += 2;
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numLost == 2 && stats.numRejected == 2 &&
+          sameParams(receiver.getParams(), held),
+          "loss: values held until the next keyframe");
+
+    sender.send(makeParams(30 * 0.1));
+    sender.save();
+    sender.send(makeParams(31 * 0.1));
+    sender.send(params = makeParams(32 * 0.1));
+    numSent += 3;
+    stats = waitForPackets(receiver, numSent);
+    check(sameParams(receiver.getParams(), params),
+          "loss: resynced from the keyframe");
+
+    // A late keyframe is ignored like a late delta, not taken for a
+    // restart. It is not counted anywhere, so give it time to arrive.
+    sender.sendSaved();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    stats = receiver.getStats();
+    check(stats.numResets == 0 && sameParams(receiver.getParams(), params),
+          "late keyframe: ignored");
+    sender.send(params = makeParams(33 * 0.1));
+    numSent++;
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numLost == 2 && stats.numPackets + stats.numRejected == numSent &&
+          sameParams(receiver.getParams(), params),
+          "late keyframe: no packets seen as lost after it");
+
+    // Run for a long time, then restart the sender
+    for (int i = 34; i < 5000; i++)
+    {
+        sender.send(params = makeParams(i * 0.1));
+        numSent++;
+        if (i % 100 == 0)
+        {
+            // Do not overflow the socket buffer
+            waitForPackets(receiver, numSent);
+        }
+    }
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numLost == 2 && sameParams(receiver.getParams(), params),
+          "long run: nothing more lost");
+    std::uint64_t numApplied = stats.numPackets;
+
+    sender.restart();
+    for (int i = 0; i < 100; i++)
+    {
+        sender.send(params = makeParams(100 + i * 0.1));
+        numSent++;
+    }
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numResets == 1 && stats.numPackets == numApplied + 100 &&
+          sameParams(receiver.getParams(), params),
+          "restart: followed from the first keyframe");
+
+    // A restart whose first keyframe is lost: the deltas up to the next
+    // keyframe are rejected
+    sender.restart();
+    sender.send(makeParams(200), true);
+    for (int i = 1; i < 15; i++)
+    {
+        sender.send(params = makeParams(200 + i * 0.1));
+    }
+    numSent += 14;
+    stats = waitForPackets(receiver, numSent);
+    check(stats.numResets == 2 && sameParams(receiver.getParams(), params),
+          "restart with a lost keyframe: resynced from the next one");
+
+    receiver.stop();
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? std::atoi(argv[1]) : 12580;
+
+    testDetector(port);
+    testLossAndRestart(port + 2);
+
+    std::printf("%s\n", g_ok ? "PASS" : "FAIL");
+    return g_ok ? 0 : 1;
+}
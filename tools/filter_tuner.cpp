@@ -0,0 +1,467 @@
+// Tunes the filter parameters in the config file against recorded
+// OSF sessions (see osf_record).
+//
+// Every recording is replayed through an offline FacialLandmarkDetector,
+// i.e. through exactly the same feature and filter code as the live
+// detector, once for every candidate setting of the filter parameters
+// (<param>NumTaps, <param>MedianTaps and <param>HampelThreshold). The
+// candidates are spread over all CPU cores.
+//
+// Each parameter is scored separately (the four eyebrow values, which
+// share one set of filter parameters, together), by comparing its
+// filtered output with the unfiltered values from the same recordings:
+//  - jitter: energy of the second difference of the output, relative to
+//    that of the unfiltered values (1 = no smoothing at all)
+//  - lag: delay in frames at which the output best matches the
+//    unfiltered values
+// score = jitter + lagWeight * lag, lower is better.
+//
+// The thresholds that map landmark geometry to parameter values (Section
+// 1 of the config file) are not tuned, since that needs to know what the
+// face was actually doing, which a recording alone does not tell.
+//
+// Usage: filter_tuner [--config BASE_CONFIG] [--output OUTPUT_CONFIG]
+//                     [--lag-weight W] [--max-taps N] [--threads N]
+//                     RECORDING...
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "facial_landmark_detector.h"
+
+typedef FacialLandmarkDetector::Params Params;
+
+// The config name prefixes of the filter parameters, and the parameter
+// values filtered with each
+struct TunedParam
+{
+    const char *cfgPrefix;
+    std::size_t numValues;
+    double Params::*values[4];
+};
+
+static const TunedParam tunedParams[] = {
+    { "faceXAngle", 1, { &Params::faceXAngle } },
+    { "faceYAngle", 1, { &Params::faceYAngle } },
+    { "faceZAngle", 1, { &Params::faceZAngle } },
+    { "mouthForm", 1, { &Params::mouthForm } },
+    { "mouthOpen", 1, { &Params::mouthOpenness } },
+    { "leftEyeOpen", 1, { &Params::leftEyeOpenness } },
+    { "rightEyeOpen", 1, { &Params::rightEyeOpenness } },
+    { "eyebrow", 4, { &Params::leftEyebrowUpDown, &Params::rightEyebrowUpDown,
+                      &Params::leftEyebrowAngle, &Params::rightEyebrowAngle } },
+};
+static const std::size_t numTunedParams = sizeof tunedParams / sizeof tunedParams[0];
+
+struct Candidate
+{
+    std::size_t numTaps;
+    std::size_t medianTaps;
+    double hampelThreshold;
+};
+
+struct Score
+{
+    double jitter;
+    double lag;
+    double total;
+};
+
+// series[session][param][value][frame]
+typedef std::vector<std::vector<std::vector<std::vector<double>>>> Series;
+
+struct Options
+{
+    std::string baseConfig;
+    std::string output;
+    double lagWeight;
+    std::size_t maxTaps;
+    unsigned int numThreads;
+    std::vector<std::string> recordings;
+};
+
+static const std::size_t maxLag = 20;
+
+static std::string candidateOverrides(const Candidate& c)
+{
+    std::ostringstream ss;
+    for (const TunedParam& param : tunedParams)
+    {
+        ss << param.cfgPrefix << "NumTaps " << c.numTaps << "\n"
+           << param.cfgPrefix << "MedianTaps " << c.medianTaps << "\n"
+           << param.cfgPrefix << "HampelThreshold " << c.hampelThreshold << "\n";
+    }
+    return ss.str();
+}
+
+/*! Replay all recordings with the given config overrides */
+static Series replay(const Options& opt,
+                     const std::vector<std::vector<char>>& recordings,
+                     const std::string& overrides)
+{
+    const std::size_t packetSize = FacialLandmarkDetector::osfPacketSize;
+    Series series(recordings.size(),
+                  std::vector<std::vector<std::vector<double>>>(numTunedParams));
+
+    for (std::size_t s = 0; s < recordings.size(); s++)
+    {
+        FacialLandmarkDetector detector(opt.baseConfig,
+                                        FacialLandmarkDetector::INPUT_OFFLINE,
+                                        overrides);
+        const std::vector<char>& rec = recordings[s];
+        for (std::size_t p = 0; p < numTunedParams; p++)
+        {
+            series[s][p].resize(tunedParams[p].numValues);
+        }
+
+        for (std::size_t offset = 0; offset + packetSize <= rec.size();
+             offset += packetSize)
+        {
+            if (!detector.processPacket(rec.data() + offset, packetSize))
+            {
+                continue;
+            }
+
+            auto params = detector.getParams();
+            for (std::size_t p = 0; p < numTunedParams; p++)
+            {
+                for (std::size_t v = 0; v < tunedParams[p].numValues; v++)
+                {
+                    series[s][p][v].push_back(params.*tunedParams[p].values[v]);
+                }
+            }
+        }
+    }
+
+    return series;
+}
+
+static double jitterEnergy(const std::vector<double>& x, std::size_t skip)
+{
+    double sum = 0;
+    std::size_t n = 0;
+    for (std::size_t t = std::max<std::size_t>(skip, 2); t < x.size(); t++)
+    {
+        double d2 = x[t] - 2 * x[t - 1] + x[t - 2];
+        sum += d2 * d2;
+        n++;
+    }
+    return n ? sum / n : 0;
+}
+
+static double matchError(const std::vector<double>& filtered,
+                         const std::vector<double>& raw,
+                         std::size_t lag, std::size_t skip)
+{
+    double sum = 0;
+    std::size_t n = 0;
+    for (std::size_t t = std::max(skip, lag); t < filtered.size(); t++)
+    {
+        double d = filtered[t] - raw[t - lag];
+        sum += d * d;
+        n++;
+    }
+    return n ? sum / n : 0;
+}
+
+static Score scoreParam(const Options& opt, const Series& raw,
+                        const Series& filtered, std::size_t p)
+{
+    // Skip the first frames, while the filters fill up
+    const std::size_t skip = opt.maxTaps;
+
+    double jitter = 0, rawJitter = 0;
+    std::vector<double> lagError(maxLag + 1, 0);
+
+    for (std::size_t s = 0; s < raw.size(); s++)
+    {
+        for (std::size_t v = 0; v < tunedParams[p].numValues; v++)
+        {
+            jitter += jitterEnergy(filtered[s][p][v], skip);
+            rawJitter += jitterEnergy(raw[s][p][v], skip);
+            for (std::size_t lag = 0; lag <= maxLag; lag++)
+            {
+                lagError[lag] += matchError(filtered[s][p][v], raw[s][p][v],
+                                            lag, skip);
+            }
+        }
+    }
+
+    // Find the best matching delay, refined with a parabola through
+    // its neighbours
+    std::size_t best = std::min_element(lagError.begin(), lagError.end())
+                     - lagError.begin();
+    double lag = best;
+    if (best > 0 && best < maxLag)
+    {
+        double a = lagError[best - 1], b = lagError[best], c = lagError[best + 1];
+        double denom = a - 2 * b + c;
+        if (denom > 0)
+        {
+            lag += 0.5 * (a - c) / denom;
+        }
+    }
+
+    Score score;
+    score.jitter = rawJitter > 0 ? jitter / rawJitter : 0;
+    score.lag = lag;
+    score.total = score.jitter + opt.lagWeight * score.lag;
+    return score;
+}
+
+static void writeConfig(const Options& opt,
+                        const std::vector<Candidate>& best)
+{
+    std::vector<std::string> lines;
+    if (opt.baseConfig != "")
+    {
+        std::ifstream in(opt.baseConfig);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            lines.push_back(line);
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> values;
+    for (std::size_t p = 0; p < numTunedParams; p++)
+    {
+        std::string prefix = tunedParams[p].cfgPrefix;
+        std::ostringstream hampel;
+        hampel << best[p].hampelThreshold;
+        values.push_back({ prefix + "NumTaps", std::to_string(best[p].numTaps) });
+        values.push_back({ prefix + "MedianTaps", std::to_string(best[p].medianTaps) });
+        values.push_back({ prefix + "HampelThreshold", hampel.str() });
+    }
+
+    // Replace the values in place where the base config has them...
+    std::vector<bool> written(values.size(), false);
+    for (std::string& line : lines)
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream ss(line);
+        std::string name;
+        ss >> name;
+        for (std::size_t i = 0; i < values.size(); i++)
+        {
+            if (name == values[i].first)
+            {
+                line = name + " " + values[i].second;
+                written[i] = true;
+            }
+        }
+    }
+
+    // ... and append the rest
+    bool headerWritten = false;
+    for (std::size_t i = 0; i < values.size(); i++)
+    {
+        if (!written[i])
+        {
+            if (!headerWritten)
+            {
+                lines.push_back("");
+                lines.push_back("# Filter parameters chosen by filter_tuner");
+                headerWritten = true;
+            }
+            lines.push_back(values[i].first + " " + values[i].second);
+        }
+    }
+
+    std::ofstream out(opt.output);
+    for (const std::string& line : lines)
+    {
+        out << line << "\n";
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write " + opt.output);
+    }
+}
+
+static Options parseArgs(int argc, char *argv[])
+{
+    Options opt;
+    opt.output = "tuned_config.txt";
+    opt.lagWeight = 0.1;
+    opt.maxTaps = 10;
+    opt.numThreads = std::thread::hardware_concurrency();
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg[0] != '-')
+        {
+            opt.recordings.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::istringstream ss(argv[++i]);
+        bool ok = true;
+        if (arg == "--config")
+        {
+            opt.baseConfig = ss.str();
+        }
+        else if (arg == "--output")
+        {
+            opt.output = ss.str();
+        }
+        else if (arg == "--lag-weight")
+        {
+            ok = static_cast<bool>(ss >> opt.lagWeight);
+        }
+        else if (arg == "--max-taps")
+        {
+            ok = static_cast<bool>(ss >> opt.maxTaps) && opt.maxTaps > 0;
+        }
+        else if (arg == "--threads")
+        {
+            ok = static_cast<bool>(ss >> opt.numThreads);
+        }
+        else
+        {
+            throw std::runtime_error("Unrecognized argument: " + arg);
+        }
+
+        if (!ok)
+        {
+            throw std::runtime_error("Invalid value for " + arg);
+        }
+    }
+
+    if (opt.recordings.empty())
+    {
+        throw std::runtime_error("No recordings given");
+    }
+    if (opt.numThreads == 0)
+    {
+        opt.numThreads = 1;
+    }
+
+    return opt;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    try
+    {
+        opt = parseArgs(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n"
+                     "Usage: %s [--config BASE_CONFIG] [--output OUTPUT_CONFIG]\n"
+                     "       [--lag-weight W] [--max-taps N] [--threads N] RECORDING...\n",
+                     e.what(), argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<char>> recordings;
+    for (const std::string& path : opt.recordings)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            std::fprintf(stderr, "Cannot open %s\n", path.c_str());
+            return 1;
+        }
+        recordings.emplace_back(std::istreambuf_iterator<char>(in),
+                                std::istreambuf_iterator<char>());
+    }
+
+    // Unfiltered values to compare against
+    Candidate unfiltered = { 1, 0, 0 };
+    Series raw = replay(opt, recordings, candidateOverrides(unfiltered));
+
+    std::vector<Candidate> candidates;
+    for (std::size_t taps = 1; taps <= opt.maxTaps; taps++)
+    {
+        candidates.push_back({ taps, 0, 0 });
+        for (std::size_t median : { 3, 5 })
+        {
+            for (double hampel : { 0.0, 2.0, 3.0 })
+            {
+                candidates.push_back({ taps, median, hampel });
+            }
+        }
+    }
+
+    // scores[candidate][param]
+    std::vector<std::vector<Score>> scores(candidates.size());
+    std::atomic<std::size_t> nextCandidate(0);
+
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < opt.numThreads; w++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            std::size_t c;
+            while ((c = nextCandidate++) < candidates.size())
+            {
+                Series filtered = replay(opt, recordings,
+                                         candidateOverrides(candidates[c]));
+                for (std::size_t p = 0; p < numTunedParams; p++)
+                {
+                    scores[c].push_back(scoreParam(opt, raw, filtered, p));
+                }
+            }
+        }));
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    std::vector<Candidate> best(numTunedParams);
+    std::printf("%-14s %6s %8s %8s %10s %8s %8s\n",
+                "parameter", "taps", "median", "hampel", "jitter", "lag", "score");
+    for (std::size_t p = 0; p < numTunedParams; p++)
+    {
+        std::size_t bestIndex = 0;
+        for (std::size_t c = 1; c < candidates.size(); c++)
+        {
+            if (scores[c][p].total < scores[bestIndex][p].total)
+            {
+                bestIndex = c;
+            }
+        }
+        best[p] = candidates[bestIndex];
+
+        const Score& s = scores[bestIndex][p];
+        std::printf("%-14s %6zu %8zu %8.1f %10.4f %8.2f %8.4f\n",
+                    tunedParams[p].cfgPrefix, best[p].numTaps,
+                    best[p].medianTaps, best[p].hampelThreshold,
+                    s.jitter, s.lag, s.total);
+    }
+
+    try
+    {
+        writeConfig(opt, best);
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    std::printf("Wrote %s\n", opt.output.c_str());
+
+    return 0;
+}
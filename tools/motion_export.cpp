@@ -0,0 +1,481 @@
+// Converts recorded OSF sessions (see osf_record) into Cubism motions
+// (.motion3.json), e.g. to reuse a recorded performance as an idle motion.
+//
+// Every recording is replayed through an offline FacialLandmarkDetector,
+// as fast as possible, with one recording per worker thread. A curve is
+// written for every parameter binding of the config file (Section 4), so
+// the motion drives the same Cubism parameters as the live detector.
+//
+// The curves are simplified while replaying: a keyframe is only emitted
+// when a straight line from the previous keyframe can no longer pass
+// within the tolerance of every frame in between. Keyframes go straight
+// to a temporary file per curve, so a session is never held in memory;
+// the motion file is assembled from those once the header (which needs
+// the final counts) is known.
+//
+// Usage: motion_export [--config CONFIG] [--output-dir DIR]
+//                      [--tolerance T] [--threads N] INPUT...
+//
+// Each INPUT is a recording, or a directory whose *.osf files are all
+// converted. The output for foo.osf is DIR/foo.motion3.json. The
+// tolerance is a fraction of the range of each parameter (60 degrees
+// for the angles, 2 for the eyebrows, 1 for everything else).
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "facial_landmark_detector.h"
+
+struct Options
+{
+    std::string config;
+    std::string outputDir;
+    double tolerance;
+    unsigned int numThreads;
+    std::vector<std::string> recordings;
+};
+
+/*! Writes the segments of one linear curve to a temporary file,
+ *  dropping keyframes that a straight line can stand in for.
+ */
+class CurveWriter
+{
+public:
+    CurveWriter(double tolerance)
+        : m_file(std::tmpfile()), m_tolerance(tolerance),
+          m_numPoints(0), m_pending(false)
+    {
+        if (!m_file)
+        {
+            throw std::runtime_error("Cannot create temporary file");
+        }
+    }
+
+    ~CurveWriter()
+    {
+        std::fclose(m_file);
+    }
+
+    void add(double t, double v)
+    {
+        if (m_numPoints == 0)
+        {
+            emit(t, v);
+            return;
+        }
+        if (t <= m_lastT)
+        {
+            return;
+        }
+
+        // Range of slopes from the last keyframe that stay within the
+        // tolerance of every frame since
+        double dt = t - m_anchorT;
+        double lo = std::max(m_slopeLo, (v - m_tolerance - m_anchorV) / dt);
+        double hi = std::min(m_slopeHi, (v + m_tolerance - m_anchorV) / dt);
+
+        if (lo > hi)
+        {
+            // This frame cannot be reached: end the segment at the
+            // previous one, and start again from there
+            emitPending();
+            dt = t - m_anchorT;
+            lo = (v - m_tolerance - m_anchorV) / dt;
+            hi = (v + m_tolerance - m_anchorV) / dt;
+        }
+
+        m_slopeLo = lo;
+        m_slopeHi = hi;
+        m_lastT = t;
+        m_lastV = v;
+        m_pending = true;
+    }
+
+    void finish(void)
+    {
+        if (m_pending)
+        {
+            emitPending();
+        }
+        std::fflush(m_file);
+        if (std::ferror(m_file))
+        {
+            throw std::runtime_error("Cannot write temporary file");
+        }
+    }
+
+    void copyTo(std::FILE *out) const
+    {
+        std::rewind(m_file);
+        char buf[4096];
+        std::size_t n;
+        while ((n = std::fread(buf, 1, sizeof buf, m_file)) > 0)
+        {
+            std::fwrite(buf, 1, n, out);
+        }
+    }
+
+    std::size_t numPoints(void) const
+    {
+        return m_numPoints;
+    }
+
+private:
+    CurveWriter(const CurveWriter&) = delete;
+    CurveWriter& operator=(const CurveWriter&) = delete;
+
+    void emitPending(void)
+    {
+        // Use a slope that suits all frames of the segment, rather than
+        // the exact value of the last frame
+        double dt = m_lastT - m_anchorT;
+        double slope = (m_lastV - m_anchorV) / dt;
+        slope = std::min(std::max(slope, m_slopeLo), m_slopeHi);
+        emit(m_lastT, m_anchorV + slope * dt);
+    }
+
+    void emit(double t, double v)
+    {
+        // The first point stands alone; every further one is a linear
+        // segment (type 0) ending there
+        std::fprintf(m_file, m_numPoints == 0 ? "%.3f,%.4f" : ",0,%.3f,%.4f", t, v);
+        m_numPoints++;
+
+        m_anchorT = m_lastT = t;
+        m_anchorV = m_lastV = v;
+        m_slopeLo = -std::numeric_limits<double>::infinity();
+        m_slopeHi = std::numeric_limits<double>::infinity();
+        m_pending = false;
+    }
+
+    std::FILE *m_file;
+    double m_tolerance;
+    std::size_t m_numPoints;
+
+    double m_anchorT, m_anchorV;  // Last keyframe
+    double m_lastT, m_lastV;      // Last frame
+    double m_slopeLo, m_slopeHi;
+    bool m_pending;               // Whether there are frames after the last keyframe
+};
+
+static double paramRange(FacialLandmarkDetector::ParamIndex param)
+{
+    switch (param)
+    {
+    case FacialLandmarkDetector::PARAM_FACE_X_ANGLE:
+    case FacialLandmarkDetector::PARAM_FACE_Y_ANGLE:
+    case FacialLandmarkDetector::PARAM_FACE_Z_ANGLE:
+        return 60;
+    case FacialLandmarkDetector::PARAM_LEFT_EYEBROW_UP_DOWN:
+    case FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_UP_DOWN:
+    case FacialLandmarkDetector::PARAM_LEFT_EYEBROW_ANGLE:
+    case FacialLandmarkDetector::PARAM_RIGHT_EYEBROW_ANGLE:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static std::string jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+static std::string outputPath(const Options& opt, const std::string& recording)
+{
+    std::string name = recording.substr(recording.find_last_of('/') + 1);
+    std::size_t dot = name.rfind(".osf");
+    if (dot != std::string::npos && dot + 4 == name.size())
+    {
+        name.erase(dot);
+    }
+    return opt.outputDir + "/" + name + ".motion3.json";
+}
+
+/*! Convert one recording. Returns the number of frames in the motion. */
+static std::size_t exportMotion(const Options& opt, const std::string& recording)
+{
+    const std::size_t packetSize = FacialLandmarkDetector::osfPacketSize;
+
+    std::ifstream in(recording, std::ios::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Cannot open " + recording);
+    }
+
+    FacialLandmarkDetector detector(opt.config,
+                                    FacialLandmarkDetector::INPUT_OFFLINE);
+    const auto& bindings = detector.getBindings();
+
+    std::vector<std::unique_ptr<CurveWriter>> curves;
+    for (const auto& binding : bindings)
+    {
+        curves.emplace_back(new CurveWriter(opt.tolerance * paramRange(binding.param)));
+    }
+
+    std::vector<char> packet(packetSize);
+    FacialLandmarkDetector::ParamArray values;
+    std::size_t numFrames = 0;
+    double startTime = 0, duration = 0;
+
+    while (in.read(packet.data(), packetSize))
+    {
+        if (!detector.processPacket(packet.data(), packetSize))
+        {
+            continue;
+        }
+
+        // OSF timestamp, see FacialLandmarkDetector::processPacket()
+        double timestamp;
+        std::memcpy(&timestamp, packet.data(), sizeof timestamp);
+        if (numFrames == 0)
+        {
+            startTime = timestamp;
+        }
+        double t = timestamp - startTime;
+        if (numFrames > 0 && t <= duration)
+        {
+            continue;
+        }
+        duration = t;
+        numFrames++;
+
+        detector.getParamArray(values);
+        for (std::size_t i = 0; i < values.size; i++)
+        {
+            curves[i]->add(t, values.values[i]);
+        }
+    }
+
+    std::size_t totalPoints = 0;
+    for (const auto& curve : curves)
+    {
+        curve->finish();
+        totalPoints += curve->numPoints();
+    }
+
+    std::string path = outputPath(opt, recording);
+    std::FILE *out = std::fopen(path.c_str(), "w");
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write " + path);
+    }
+
+    // Every point except the first of each curve ends a linear segment
+    std::fprintf(out,
+                 "{\n"
+                 "  \"Version\": 3,\n"
+                 "  \"Meta\": {\n"
+                 "    \"Duration\": %.3f,\n"
+                 "    \"Fps\": %.1f,\n"
+                 "    \"Loop\": false,\n"
+                 "    \"AreBeziersRestricted\": true,\n"
+                 "    \"CurveCount\": %zu,\n"
+                 "    \"TotalSegmentCount\": %zu,\n"
+                 "    \"TotalPointCount\": %zu,\n"
+                 "    \"UserDataCount\": 0,\n"
+                 "    \"TotalUserDataSize\": 0\n"
+                 "  },\n"
+                 "  \"Curves\": [",
+                 duration,
+                 duration > 0 ? (numFrames - 1) / duration : 30.0,
+                 curves.size(),
+                 totalPoints - std::min(totalPoints, curves.size()),
+                 totalPoints);
+
+    for (std::size_t i = 0; i < curves.size(); i++)
+    {
+        std::fprintf(out,
+                     "%s\n    {\n"
+                     "      \"Target\": \"Parameter\",\n"
+                     "      \"Id\": %s,\n"
+                     "      \"Segments\": [",
+                     i == 0 ? "" : ",",
+                     jsonString(bindings[i].cubismId).c_str());
+        curves[i]->copyTo(out);
+        std::fprintf(out, "]\n    }");
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+
+    if (std::fclose(out) != 0)
+    {
+        throw std::runtime_error("Cannot write " + path);
+    }
+
+    return numFrames;
+}
+
+static bool isDirectory(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void addRecordings(Options& opt, const std::string& input)
+{
+    if (!isDirectory(input))
+    {
+        opt.recordings.push_back(input);
+        return;
+    }
+
+    DIR *dir = opendir(input.c_str());
+    if (!dir)
+    {
+        throw std::runtime_error("Cannot open directory " + input);
+    }
+
+    std::vector<std::string> found;
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".osf") == 0)
+        {
+            found.push_back(input + "/" + name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end());
+    opt.recordings.insert(opt.recordings.end(), found.begin(), found.end());
+}
+
+static Options parseArgs(int argc, char *argv[])
+{
+    Options opt;
+    opt.outputDir = ".";
+    opt.tolerance = 0.005;
+    opt.numThreads = std::thread::hardware_concurrency();
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg[0] != '-')
+        {
+            addRecordings(opt, arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::istringstream ss(argv[++i]);
+        bool ok = true;
+        if (arg == "--config")
+        {
+            opt.config = ss.str();
+        }
+        else if (arg == "--output-dir")
+        {
+            opt.outputDir = ss.str();
+        }
+        else if (arg == "--tolerance")
+        {
+            ok = static_cast<bool>(ss >> opt.tolerance) && opt.tolerance >= 0;
+        }
+        else if (arg == "--threads")
+        {
+            ok = static_cast<bool>(ss >> opt.numThreads);
+        }
+        else
+        {
+            throw std::runtime_error("Unrecognized argument: " + arg);
+        }
+
+        if (!ok)
+        {
+            throw std::runtime_error("Invalid value for " + arg);
+        }
+    }
+
+    if (opt.recordings.empty())
+    {
+        throw std::runtime_error("No recordings given");
+    }
+    if (opt.numThreads == 0)
+    {
+        opt.numThreads = 1;
+    }
+
+    return opt;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    try
+    {
+        opt = parseArgs(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n"
+                     "Usage: %s [--config CONFIG] [--output-dir DIR]\n"
+                     "       [--tolerance T] [--threads N] INPUT...\n",
+                     e.what(), argv[0]);
+        return 1;
+    }
+
+    std::atomic<std::size_t> nextRecording(0);
+    std::atomic<bool> failed(false);
+    std::mutex printMutex;
+
+    std::vector<std::thread> workers;
+    unsigned int numWorkers = std::min<std::size_t>(opt.numThreads,
+                                                    opt.recordings.size());
+    for (unsigned int w = 0; w < numWorkers; w++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            std::size_t r;
+            while ((r = nextRecording++) < opt.recordings.size())
+            {
+                const std::string& recording = opt.recordings[r];
+                try
+                {
+                    std::size_t numFrames = exportMotion(opt, recording);
+                    std::lock_guard<std::mutex> lock(printMutex);
+                    std::printf("%s: %zu frames -> %s\n", recording.c_str(),
+                                numFrames, outputPath(opt, recording).c_str());
+                }
+                catch (const std::exception& e)
+                {
+                    std::lock_guard<std::mutex> lock(printMutex);
+                    std::fprintf(stderr, "%s: %s\n", recording.c_str(), e.what());
+                    failed = true;
+                }
+            }
+        }));
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+// Records the UDP packets sent by OpenSeeFace to a file, for replaying
+// through the offline tools (e.g. filter_tuner).
+//
+// The file is simply the OSF packets one after another, each exactly
+// FacialLandmarkDetector::osfPacketSize bytes long. Packets of any other
+// size are skipped.
+//
+// Usage: osf_record [--ip ADDRESS] [--port PORT] [--seconds S] OUTPUT_FILE
+//
+// Recording stops after the given number of seconds, or on Ctrl-C.
+// Note that this binds the same port as the detector, so the detector
+// cannot run on the same port at the same time, unless ADDRESS is an IPv4
+// multicast group (see osfIpAddress in config.txt).
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "facial_landmark_detector.h"
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+    stopRequested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string ip = "127.0.0.1";
+    int port = 11573;
+    double seconds = 0; // 0 = until Ctrl-C
+    std::string outPath;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        std::istringstream ss(hasValue ? argv[i + 1] : "");
+
+        if (arg == "--ip" && hasValue)
+        {
+            ip = argv[++i];
+        }
+        else if (arg == "--port" && hasValue && (ss >> port))
+        {
+            i++;
+        }
+        else if (arg == "--seconds" && hasValue && (ss >> seconds))
+        {
+            i++;
+        }
+        else if (arg[0] != '-' && outPath == "")
+        {
+            outPath = arg;
+        }
+        else
+        {
+            std::fprintf(stderr, "Invalid argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (outPath == "")
+    {
+        std::fprintf(stderr, "Usage: %s [--ip ADDRESS] [--port PORT] "
+                             "[--seconds S] OUTPUT_FILE\n", argv[0]);
+        return 1;
+    }
+
+    std::ofstream out(outPath, std::ios::binary);
+    if (!out)
+    {
+        std::fprintf(stderr, "Cannot open %s\n", outPath.c_str());
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+    // For an IPv4 multicast group, share the stream with the detector
+    bool multicast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+    int on = 1;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock >= 0 && multicast)
+    {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    }
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof addr) != 0)
+    {
+        std::fprintf(stderr, "Cannot bind to %s:%d\n", ip.c_str(), port);
+        return 1;
+    }
+
+    if (multicast)
+    {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) != 0)
+        {
+            std::fprintf(stderr, "Cannot join multicast group %s\n", ip.c_str());
+            return 1;
+        }
+    }
+
+    // Wake up periodically to check for Ctrl-C and the time limit
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    std::vector<char> buf(FacialLandmarkDetector::osfPacketSize + 1);
+    unsigned long numPackets = 0;
+    auto startTime = std::chrono::steady_clock::now();
+
+    while (!stopRequested)
+    {
+        if (seconds > 0 &&
+            std::chrono::steady_clock::now() - startTime >
+                std::chrono::duration<double>(seconds))
+        {
+            break;
+        }
+
+        auto size = recv(sock, buf.data(), buf.size(), 0);
+        if (size != static_cast<ssize_t>(FacialLandmarkDetector::osfPacketSize))
+        {
+            continue;
+        }
+
+        out.write(buf.data(), size);
+        numPackets++;
+    }
+
+    close(sock);
+    std::fprintf(stderr, "Recorded %lu packets to %s\n",
+                 numPackets, outPath.c_str());
+    return 0;
+}
@@ -0,0 +1,301 @@
+// Throughput benchmark for DetectorServer.
+//
+// Creates an increasing number of tenants, feeds each of them synthetic
+// OSF packets at a fixed frame rate over loopback, and reports how many
+// frames were processed and how much CPU it took. For comparison the same
+// is done with one library-owned thread per detector.
+//
+// Usage: server_bench [--workers N] [--streams 1,10,100] [--rate FPS]
+//                     [--seconds S] [--port BASE_PORT]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "detector_server.h"
+
+// Same layout as in facial_landmark_detector.cpp
+static const int packetFrameSize = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                 + 4 * 4 + 4 * 68 + 4 * 2 * 68 + 4 * 3 * 70 + 4 * 14;
+static const int confidenceOffset = 8 + 4 + 2 * 4 + 2 * 4 + 1 + 4 + 3 * 4 + 3 * 4
+                                  + 4 * 4;
+static const int landmarksOffset = confidenceOffset + 4 * 68;
+
+struct Options
+{
+    unsigned int workers;
+    std::vector<int> streams;
+    double rate;
+    double seconds;
+    int basePort;
+};
+
+struct Result
+{
+    std::uint64_t sent;
+    std::uint64_t processed;
+    double cpuSeconds;
+    double wallSeconds;
+    double avgFrameUs;
+    double maxFrameUs;
+};
+
+/*! A crude face that moves a little over time */
+static void makePacket(char *buf, double t)
+{
+    std::memset(buf, 0, packetFrameSize);
+    std::memcpy(buf, &t, sizeof t);
+
+    for (int i = 0; i < 68; i++)
+    {
+        float confidence = 0.9f;
+        std::memcpy(buf + confidenceOffset + i * 4, &confidence, 4);
+
+        double angle = i / 68.0 * 2 * 3.14159265358979;
+        float x = 200 + 80 * std::cos(angle) + 2 * std::sin(t + i);
+        float y = 200 + 100 * std::sin(angle) + 2 * std::cos(t * 1.3 + i);
+        std::memcpy(buf + landmarksOffset + i * 8, &x, 4);
+        std::memcpy(buf + landmarksOffset + i * 8 + 4, &y, 4);
+    }
+}
+
+static double cpuTime(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static std::string writeConfig(int port)
+{
+    std::ostringstream path;
+    path << "/tmp/flc_server_bench_" << getpid() << "_" << port << ".txt";
+    std::ofstream file(path.str());
+    file << "osfIpAddress 127.0.0.1\nosfPort " << port << "\n";
+    if (!file)
+    {
+        throw std::runtime_error("Cannot write " + path.str());
+    }
+    return path.str();
+}
+
+/*! Send packets to all ports at opt.rate frames per second each */
+static std::uint64_t sendPackets(const Options& opt, int numStreams)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        throw std::runtime_error("Cannot create UDP socket");
+    }
+
+    std::vector<struct sockaddr_in> addrs(numStreams);
+    for (int i = 0; i < numStreams; i++)
+    {
+        std::memset(&addrs[i], 0, sizeof addrs[i]);
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_port = htons(opt.basePort + i);
+        addrs[i].sin_addr.s_addr = inet_addr("127.0.0.1");
+    }
+
+    char buf[packetFrameSize];
+    std::uint64_t sent = 0;
+    auto period = std::chrono::duration<double>(1 / opt.rate);
+    auto start = std::chrono::steady_clock::now();
+    auto next = start;
+    int numFrames = static_cast<int>(opt.rate * opt.seconds);
+
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        double t = frame / opt.rate;
+        for (int i = 0; i < numStreams; i++)
+        {
+            makePacket(buf, t + i);
+            if (sendto(sock, buf, sizeof buf, 0,
+                       (struct sockaddr *)&addrs[i], sizeof addrs[i]) == packetFrameSize)
+            {
+                sent++;
+            }
+        }
+        next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+        std::this_thread::sleep_until(next);
+    }
+
+    close(sock);
+    return sent;
+}
+
+static Result runServer(const Options& opt, int numStreams)
+{
+    DetectorServer server(opt.workers);
+    std::vector<std::string> cfgPaths;
+    for (int i = 0; i < numStreams; i++)
+    {
+        cfgPaths.push_back(writeConfig(opt.basePort + i));
+        server.addTenant("tenant" + std::to_string(i), cfgPaths.back());
+    }
+
+    server.start();
+    double cpuStart = cpuTime();
+    auto wallStart = std::chrono::steady_clock::now();
+
+    Result result = {};
+    result.sent = sendPackets(opt, numStreams);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    result.cpuSeconds = cpuTime() - cpuStart;
+    result.wallSeconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - wallStart).count();
+    server.stop();
+
+    std::uint64_t busyNs = 0;
+    for (const auto& stats : server.getTenantStats())
+    {
+        result.processed += stats.numFrames;
+        busyNs += stats.busyNs;
+        result.maxFrameUs = std::max(result.maxFrameUs, stats.maxFrameNs / 1e3);
+    }
+    if (result.processed > 0)
+    {
+        result.avgFrameUs = busyNs / 1e3 / result.processed;
+    }
+
+    for (const auto& path : cfgPaths)
+    {
+        std::remove(path.c_str());
+    }
+    return result;
+}
+
+static Result runThreads(const Options& opt, int numStreams)
+{
+    std::vector<std::unique_ptr<FacialLandmarkDetector>> detectors;
+    std::vector<std::string> cfgPaths;
+    for (int i = 0; i < numStreams; i++)
+    {
+        cfgPaths.push_back(writeConfig(opt.basePort + i));
+        detectors.emplace_back(new FacialLandmarkDetector(cfgPaths.back()));
+        detectors.back()->start();
+    }
+
+    double cpuStart = cpuTime();
+    auto wallStart = std::chrono::steady_clock::now();
+
+    Result result = {};
+    result.sent = sendPackets(opt, numStreams);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    result.cpuSeconds = cpuTime() - cpuStart;
+    result.wallSeconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - wallStart).count();
+
+    for (auto& detector : detectors)
+    {
+        detector->stop();
+        result.processed += detector->getThreadStats().numFrames;
+    }
+
+    for (const auto& path : cfgPaths)
+    {
+        std::remove(path.c_str());
+    }
+    return result;
+}
+
+static void printResult(const char *mode, int numStreams, const Result& r)
+{
+    std::printf("%-8s %8d %10llu %10llu %8.1f%% %10.0f %8.1f%% %10.2f %10.2f\n",
+                mode, numStreams,
+                (unsigned long long)r.sent, (unsigned long long)r.processed,
+                r.sent ? 100.0 * r.processed / r.sent : 0.0,
+                r.processed / r.wallSeconds,
+                100.0 * r.cpuSeconds / r.wallSeconds,
+                r.avgFrameUs, r.maxFrameUs);
+}
+
+static Options parseArgs(int argc, char *argv[])
+{
+    Options opt;
+    opt.workers = 0;
+    opt.streams = {1, 10, 50, 100, 200};
+    opt.rate = 30;
+    opt.seconds = 3;
+    opt.basePort = 21000;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        std::istringstream ss(argv[i + 1]);
+        bool ok = true;
+
+        if (arg == "--workers")
+        {
+            ok = static_cast<bool>(ss >> opt.workers);
+        }
+        else if (arg == "--streams")
+        {
+            opt.streams.clear();
+            std::string item;
+            while (std::getline(ss, item, ','))
+            {
+                opt.streams.push_back(std::atoi(item.c_str()));
+            }
+            ok = !opt.streams.empty();
+        }
+        else if (arg == "--rate")
+        {
+            ok = static_cast<bool>(ss >> opt.rate) && opt.rate > 0;
+        }
+        else if (arg == "--seconds")
+        {
+            ok = static_cast<bool>(ss >> opt.seconds);
+        }
+        else if (arg == "--port")
+        {
+            ok = static_cast<bool>(ss >> opt.basePort);
+        }
+        else
+        {
+            throw std::runtime_error("Unrecognized argument: " + arg);
+        }
+
+        if (!ok)
+        {
+            throw std::runtime_error("Invalid value for " + arg);
+        }
+    }
+
+    return opt;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt = parseArgs(argc, argv);
+
+    std::printf("%-8s %8s %10s %10s %9s %10s %9s %10s %10s\n",
+                "mode", "streams", "sent", "processed", "ratio",
+                "frames/s", "cpu", "avg us", "max us");
+
+    for (int numStreams : opt.streams)
+    {
+        printResult("server", numStreams, runServer(opt, numStreams));
+        printResult("threads", numStreams, runThreads(opt, numStreams));
+    }
+
+    return 0;
+}